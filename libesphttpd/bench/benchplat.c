@@ -0,0 +1,60 @@
+/*
+Fake platform layer for the benchmarks that drive httpd.c directly. There are no sockets: the
+benchmark calls the httpd callbacks itself, and whatever the httpd sends is only counted.
+*/
+#include <time.h>
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "httpd-platform.h"
+#include "benchplat.h"
+
+struct PosixConnType {
+	int dummy;
+};
+
+PosixConnType benchConn;
+long long benchBytesSent;
+static HttpdConnData *benchConnData;
+
+//Monotonic time in nanoseconds.
+double benchNowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+int httpdPlatSendData(ConnTypePtr conn, char *buff, int len) {
+	benchBytesSent+=len;
+	return len;
+}
+
+void httpdPlatDisconnect(ConnTypePtr conn) {
+}
+
+void httpdPlatDisableTimeout(ConnTypePtr conn) {
+}
+
+void httpdPlatInit(int port, int maxConnCt) {
+}
+
+void httpdPlatSetConnData(ConnTypePtr conn, char *remIp, int remPort, HttpdConnData *hconn) {
+	benchConnData=hconn;
+}
+
+HttpdConnData *httpdPlatGetConnData(ConnTypePtr conn, char *remIp, int remPort) {
+	return benchConnData;
+}
+
+void httpdPlatLock() {
+}
+
+void httpdPlatUnlock() {
+}
+
+int httpdPlatLockSlot(int slot) {
+	return 0;
+}
+
+void httpdPlatUnlockSlot(int slot) {
+}
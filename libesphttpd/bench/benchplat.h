@@ -0,0 +1,15 @@
+#ifndef BENCHPLAT_H
+#define BENCHPLAT_H
+
+//Fake platform layer for the benchmarks that drive httpd.c directly instead of over sockets.
+//There is one fake connection; everything the httpd sends over it is only counted.
+
+#define BENCH_IP "\x7f\0\0\x01"
+#define BENCH_PORT 1234
+
+extern PosixConnType benchConn;
+extern long long benchBytesSent;
+
+double benchNowNs();
+
+#endif
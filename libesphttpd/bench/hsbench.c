@@ -0,0 +1,69 @@
+/*
+Benchmark for reading heatshrink-compressed files from an espfs image. Opens a file and reads it
+with espFsRead in pieces the size cgiEspFsHook uses, over and over, and reports the decompressed
+throughput in MB/s. The size of the blocks fed to the decoder is fixed at compile time
+(ESPFS_HEATSHRINK_INPUT_SIZE), so the Makefile builds one of these for every size to compare.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "espfs.h"
+#include "espfsformat.h"
+
+static double nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	char *fileName=argc>2?argv[2]:"angular_1.2.30.js";
+	int readLen=argc>3?atoi(argv[3]):1024;
+	char *image, *buff;
+	EspFsFile *f;
+	off_t size;
+	long long total=0;
+	int fd, n;
+	double start, t;
+
+	if (argc<2 || readLen<=0) {
+		printf("Usage: %s espfs-image [file] [read size]\n", argv[0]);
+		return 1;
+	}
+	fd=open(argv[1], O_RDONLY);
+	if (fd<0) {
+		perror(argv[1]);
+		return 1;
+	}
+	size=lseek(fd, 0, SEEK_END);
+	image=mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (image==MAP_FAILED || espFsInit(image)!=ESPFS_INIT_RESULT_OK) {
+		printf("%s: not an espfs image\n", argv[1]);
+		return 1;
+	}
+	f=espFsOpen(fileName);
+	if (f==NULL) {
+		printf("%s: no %s in image\n", argv[1], fileName);
+		return 1;
+	}
+	if (espFsDirect(f, &n)!=NULL) printf("Warning: %s isn't compressed with heatshrink.\n", fileName);
+	espFsClose(f);
+	buff=malloc(readLen);
+
+	start=nowNs();
+	do {
+		f=espFsOpen(fileName);
+		while ((n=espFsRead(f, buff, readLen))>0) total+=n;
+		espFsClose(f);
+		t=(nowNs()-start)/1e9;
+	} while (t<1.0);
+	printf("hsbench: input blocks of %3d bytes, reads of %4d bytes: %7.2f MB/s\n",
+			ESPFS_HEATSHRINK_INPUT_SIZE, readLen, total/t/(1024*1024));
+	free(buff);
+	return 0;
+}
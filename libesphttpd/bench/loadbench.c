@@ -0,0 +1,411 @@
+/*
+Load test for the httpd running on the POSIX platform layer. Serves an espfs image over a real
+socket and hammers it with a number of concurrent keep-alive HTTP clients and websocket clients
+(which send a frame and wait for the echo), optionally while another thread broadcasts to all
+websockets. Reports requests per second, p50/p99 latency and bytes per request, plus the counters
+the httpd keeps.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "httpdespfs.h"
+#include "cgiwebsocket.h"
+#include "espfs.h"
+
+#define WS_PAYLOAD_LEN 64
+
+static int port=8088;
+static const char *url="/index.html";
+static volatile int stop;
+
+//One of these per client thread. Latencies are kept so percentiles can be calculated at the end.
+typedef struct {
+	int isWs;
+	double *lat;
+	int latCt, latSize;
+	long long bytes;
+	int errors;
+	int broadcasts;
+} Client;
+
+//Small buffered reader on top of a socket.
+typedef struct {
+	int fd;
+	char buf[16384];
+	int pos, len;
+	long long bytes;
+} Reader;
+
+static double nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static void benchWsRecv(Websock *ws, char *data, int len, int flags) {
+	cgiWebsocketSend(ws, data, len, flags);
+}
+
+static void benchWsConnect(Websock *ws) {
+	ws->recvCb=benchWsRecv;
+}
+
+static const HttpdBuiltInUrl benchUrls[]={
+	{"/ws", cgiWebsocket, benchWsConnect},
+	{"*", cgiEspFsHook, NULL},
+	{NULL, NULL, NULL}
+};
+
+static int readerFill(Reader *r) {
+	int n;
+	if (r->pos==r->len) r->pos=r->len=0;
+	if (r->len==sizeof(r->buf)) return 0;
+	n=recv(r->fd, r->buf+r->len, sizeof(r->buf)-r->len, 0);
+	if (n<=0) return 0;
+	r->len+=n;
+	r->bytes+=n;
+	return 1;
+}
+
+//Reads a line, without the line end, into line. Returns 0 on error.
+static int readerLine(Reader *r, char *line, int max) {
+	int i=0;
+	while (1) {
+		while (r->pos<r->len) {
+			char c=r->buf[r->pos++];
+			if (c=='\n') {
+				if (i>0 && line[i-1]=='\r') i--;
+				line[i]=0;
+				return 1;
+			}
+			if (i<max-1) line[i++]=c;
+		}
+		if (!readerFill(r)) return 0;
+	}
+}
+
+//Reads and discards len bytes, or copies them to dst if that isn't NULL. Returns 0 on error.
+static int readerSkip(Reader *r, char *dst, long long len) {
+	int n;
+	while (len>0) {
+		if (r->pos==r->len && !readerFill(r)) return 0;
+		n=r->len-r->pos;
+		if (n>len) n=len;
+		if (dst) {
+			memcpy(dst, r->buf+r->pos, n);
+			dst+=n;
+		}
+		r->pos+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+static int benchConnect() {
+	struct sockaddr_in addr;
+	int fd=socket(AF_INET, SOCK_STREAM, 0);
+	int one=1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))!=0) {
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int sendAll(int fd, const char *data, int len) {
+	int n;
+	while (len>0) {
+		n=send(fd, data, len, MSG_NOSIGNAL);
+		if (n<=0) return 0;
+		data+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+static void addLatency(Client *c, double ns) {
+	if (c->latCt==c->latSize) {
+		c->latSize=c->latSize?c->latSize*2:4096;
+		c->lat=realloc(c->lat, c->latSize*sizeof(double));
+	}
+	c->lat[c->latCt++]=ns;
+}
+
+//Reads one response. Returns 1 if the connection can be re-used, 0 if it's closed, -1 on error.
+static int readResponse(Reader *r) {
+	char line[512];
+	long long contentLen=-1, chunkLen;
+	int chunked=0, keepAlive=1;
+	if (!readerLine(r, line, sizeof(line))) return -1;
+	if (strncmp(line, "HTTP/1.", 7)!=0) return -1;
+	if (strncmp(line+9, "200", 3)!=0) return -1;
+	while (1) {
+		if (!readerLine(r, line, sizeof(line))) return -1;
+		if (line[0]==0) break;
+		if (strncasecmp(line, "Content-Length:", 15)==0) contentLen=atoll(line+15);
+		if (strncasecmp(line, "Transfer-Encoding:", 18)==0 && strstr(line, "chunked")) chunked=1;
+		if (strncasecmp(line, "Connection:", 11)==0 && strstr(line, "close")) keepAlive=0;
+	}
+	if (chunked) {
+		do {
+			if (!readerLine(r, line, sizeof(line))) return -1;
+			chunkLen=strtoll(line, NULL, 16);
+			if (!readerSkip(r, NULL, chunkLen)) return -1;
+			if (!readerLine(r, line, sizeof(line))) return -1;
+		} while (chunkLen!=0);
+		return keepAlive;
+	}
+	if (contentLen>=0) {
+		if (!readerSkip(r, NULL, contentLen)) return -1;
+		return keepAlive;
+	}
+	//No length given: the body ends when the connection does.
+	while (readerSkip(r, NULL, 1)) ;
+	return 0;
+}
+
+static void *httpClient(void *arg) {
+	Client *c=arg;
+	Reader *r=malloc(sizeof(Reader));
+	char req[256];
+	int reqLen, ret=0;
+	double start;
+	reqLen=snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n", url);
+	r->fd=-1;
+	while (!stop) {
+		if (r->fd<0) {
+			r->fd=benchConnect();
+			r->pos=r->len=0;
+			r->bytes=0;
+			if (r->fd<0) {
+				c->errors++;
+				break;
+			}
+		}
+		start=nowNs();
+		if (sendAll(r->fd, req, reqLen)) ret=readResponse(r);
+		else ret=-1;
+		if (ret<0) {
+			c->errors++;
+		} else {
+			addLatency(c, nowNs()-start);
+			c->bytes+=r->bytes;
+			r->bytes=0;
+		}
+		if (ret<=0) {
+			close(r->fd);
+			r->fd=-1;
+		}
+	}
+	if (r->fd>=0) close(r->fd);
+	free(r);
+	return NULL;
+}
+
+//Reads one websocket frame. Returns the payload length, or -1 on error.
+static int readWsFrame(Reader *r, char *payload, int max) {
+	unsigned char hdr[8];
+	int len;
+	if (!readerSkip(r, (char*)hdr, 2)) return -1;
+	len=hdr[1]&0x7f;
+	if (len==126) {
+		if (!readerSkip(r, (char*)hdr, 2)) return -1;
+		len=(hdr[0]<<8)|hdr[1];
+	} else if (len==127) {
+		return -1;
+	}
+	if (len>max) return -1;
+	if (!readerSkip(r, payload, len)) return -1;
+	return len;
+}
+
+static void *wsClient(void *arg) {
+	Client *c=arg;
+	Reader *r=malloc(sizeof(Reader));
+	static const char hs[]="GET /ws HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	char frame[6+WS_PAYLOAD_LEN], payload[256], line[256];
+	unsigned char mask[4]={0x12, 0x34, 0x56, 0x78};
+	double start;
+	int i, n;
+
+	r->pos=r->len=0;
+	r->bytes=0;
+	r->fd=benchConnect();
+	if (r->fd<0 || !sendAll(r->fd, hs, sizeof(hs)-1) || !readerLine(r, line, sizeof(line)) ||
+			strstr(line, "101")==NULL) {
+		c->errors++;
+		goto out;
+	}
+	do {
+		if (!readerLine(r, line, sizeof(line))) {
+			c->errors++;
+			goto out;
+		}
+	} while (line[0]!=0);
+	r->bytes=0;
+
+	//Masked text frame; the payload starts with 'E' so echoes can be told apart from broadcasts.
+	frame[0]=0x81;
+	frame[1]=0x80|WS_PAYLOAD_LEN;
+	memcpy(frame+2, mask, 4);
+	for (i=0; i<WS_PAYLOAD_LEN; i++) frame[6+i]=(i==0?'E':'a'+i%26)^mask[i&3];
+	while (!stop) {
+		start=nowNs();
+		if (!sendAll(r->fd, frame, sizeof(frame))) {
+			c->errors++;
+			break;
+		}
+		do {
+			n=readWsFrame(r, payload, sizeof(payload));
+			if (n>0 && payload[0]!='E') c->broadcasts++;
+		} while (n>0 && payload[0]!='E');
+		if (n!=WS_PAYLOAD_LEN) {
+			c->errors++;
+			break;
+		}
+		addLatency(c, nowNs()-start);
+	}
+	c->bytes=r->bytes;
+out:
+	if (r->fd>=0) close(r->fd);
+	free(r);
+	return NULL;
+}
+
+static void *broadcaster(void *arg) {
+	int interval=*(int*)arg;
+	char msg[WS_PAYLOAD_LEN];
+	memset(msg, 'B', sizeof(msg));
+	while (!stop) {
+		cgiWebsockBroadcast("/ws", msg, sizeof(msg), WEBSOCK_FLAG_NONE);
+		usleep(interval);
+	}
+	return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b) {
+	double da=*(const double*)a, db=*(const double*)b;
+	return (da>db)-(da<db);
+}
+
+static void report(const char *name, Client *clients, int ct, double secs) {
+	double *all;
+	int i, n=0, errors=0, broadcasts=0;
+	long long bytes=0;
+	if (ct==0) return;
+	for (i=0; i<ct; i++) n+=clients[i].latCt;
+	all=malloc((n+1)*sizeof(double));
+	n=0;
+	for (i=0; i<ct; i++) {
+		memcpy(all+n, clients[i].lat, clients[i].latCt*sizeof(double));
+		n+=clients[i].latCt;
+		bytes+=clients[i].bytes;
+		errors+=clients[i].errors;
+		broadcasts+=clients[i].broadcasts;
+	}
+	qsort(all, n, sizeof(double), cmpDouble);
+	if (n==0) {
+		printf("loadbench: %-4s %2d conns: no requests completed, %d errors\n", name, ct, errors);
+	} else {
+		printf("loadbench: %-4s %2d conns: %9.0f req/s, p50 %8.1f us, p99 %8.1f us, %7.0f bytes/request, %d errors",
+				name, ct, n/secs, all[n/2]/1000, all[(int)(n*0.99)]/1000, (double)bytes/n, errors);
+		if (broadcasts) printf(", %d broadcasts received", broadcasts);
+		printf("\n");
+	}
+	free(all);
+}
+
+int main(int argc, char **argv) {
+	int httpCt=4, wsCt=0, secs=2, bcInterval=0, cacheSize=0;
+	int f, opt, i;
+	off_t size;
+	char *espFsData;
+	pthread_t *threads, bcThread;
+	Client *clients;
+	const HttpdStats *stats;
+	const EspFsCacheStats *cacheStats;
+	double start;
+
+	while ((opt=getopt(argc, argv, "c:w:t:u:p:b:m:"))!=-1) {
+		if (opt=='c') httpCt=atoi(optarg);
+		else if (opt=='w') wsCt=atoi(optarg);
+		else if (opt=='t') secs=atoi(optarg);
+		else if (opt=='u') url=optarg;
+		else if (opt=='p') port=atoi(optarg);
+		else if (opt=='b') bcInterval=atoi(optarg);
+		else if (opt=='m') cacheSize=atoi(optarg);
+		else optind=argc+1;
+	}
+	if (optind!=argc-1 || httpCt+wsCt<1 || httpCt+wsCt>HTTPD_MAX_CONNECTIONS) {
+		printf("Usage: %s [-c http clients] [-w websocket clients] [-t seconds] [-u url] [-p port]\n"
+				"          [-b broadcast interval in us] [-m file cache bytes] espfs-image\n"
+				"At most %d clients in total.\n", argv[0], HTTPD_MAX_CONNECTIONS);
+		exit(1);
+	}
+
+	f=open(argv[optind], O_RDONLY);
+	if (f<0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	size=lseek(f, 0, SEEK_END);
+	espFsData=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
+	if (espFsData==MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	if (espFsInit(espFsData)!=ESPFS_INIT_RESULT_OK) {
+		printf("Couldn't init espfs filesystem from %s\n", argv[optind]);
+		exit(1);
+	}
+	if (cacheSize>0) espFsCacheInit(cacheSize, cacheSize);
+	if (!httpdInit((HttpdBuiltInUrl*)benchUrls, port)) {
+		printf("Couldn't start the httpd\n");
+		exit(1);
+	}
+
+	threads=calloc(httpCt+wsCt, sizeof(pthread_t));
+	clients=calloc(httpCt+wsCt, sizeof(Client));
+	start=nowNs();
+	for (i=0; i<httpCt+wsCt; i++) {
+		clients[i].isWs=(i>=httpCt);
+		pthread_create(&threads[i], NULL, clients[i].isWs?wsClient:httpClient, &clients[i]);
+	}
+	if (bcInterval>0) pthread_create(&bcThread, NULL, broadcaster, &bcInterval);
+	sleep(secs);
+	stop=1;
+	for (i=0; i<httpCt+wsCt; i++) pthread_join(threads[i], NULL);
+	if (bcInterval>0) pthread_join(bcThread, NULL);
+
+	printf("loadbench: %s, %d s\n", url, secs);
+	report("http", clients, httpCt, (nowNs()-start)/1e9);
+	report("ws", clients+httpCt, wsCt, (nowNs()-start)/1e9);
+	stats=httpdGetStats();
+	printf("loadbench: %u requests handled, %u backlog drops, %u lock waits, %u heap allocations\n",
+			stats->requests, stats->backlogDrops, stats->lockWaits, stats->heapAllocs);
+	if (cacheSize>0) {
+		cacheStats=espFsGetCacheStats();
+		printf("loadbench: file cache: %u hits, %u misses, %u evictions, %u files of %u bytes cached\n",
+				cacheStats->hits, cacheStats->misses, cacheStats->evictions, cacheStats->files, cacheStats->bytes);
+	}
+	return 0;
+}
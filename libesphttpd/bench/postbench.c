@@ -0,0 +1,70 @@
+/*
+Benchmark for the POST body path in the httpd core. Sends a POST request with a large body to a
+cgi that only looks at the data, feeding it to httpdRecvCb in TCP-segment-sized pieces like the
+platform code would, and reports the throughput in MB/s. Optional arguments are the body size
+and the size of the pieces in bytes.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "benchplat.h"
+
+static unsigned int sum;
+static int cgiCalls;
+
+//Touches every byte of the POST data so the copy into the buffer can't be skipped.
+static int cgiBenchPost(HttpdConnData *connData) {
+	int i;
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	cgiCalls++;
+	for (i=0; i<connData->post->buffLen; i++) sum+=(unsigned char)connData->post->buff[i];
+	if (connData->post->received!=connData->post->len) return HTTPD_CGI_MORE;
+	httpdStartResponse(connData, 200);
+	httpdEndHeaders(connData);
+	return HTTPD_CGI_DONE;
+}
+
+static const HttpdBuiltInUrl benchUrls[]={
+	{"/upload", cgiBenchPost, NULL},
+	{NULL, NULL, NULL}
+};
+
+int main(int argc, char **argv) {
+	int bodyLen=argc>1?atoi(argv[1]):16*1024*1024;
+	int segLen=argc>2?atoi(argv[2]):1460;
+	char head[128];
+	char *body;
+	int headLen, pos, n, iters=8, i;
+	double start, t;
+
+	if (bodyLen<=0 || segLen<=0 || segLen>65535) {
+		printf("Usage: %s [body size] [segment size <= 65535]\n", argv[0]);
+		return 1;
+	}
+	body=malloc(bodyLen);
+	for (i=0; i<bodyLen; i++) body[i]=i*7;
+	headLen=sprintf(head, "POST /upload HTTP/1.1\r\nHost: bench\r\nContent-Length: %d\r\n\r\n", bodyLen);
+
+	if (!httpdInit((HttpdBuiltInUrl*)benchUrls, 80)) {
+		printf("Couldn't start the httpd\n");
+		return 1;
+	}
+	httpdConnectCb(&benchConn, BENCH_IP, BENCH_PORT);
+	start=benchNowNs();
+	for (i=0; i<iters; i++) {
+		httpdRecvCb(&benchConn, BENCH_IP, BENCH_PORT, head, headLen);
+		for (pos=0; pos<bodyLen; pos+=n) {
+			n=bodyLen-pos;
+			if (n>segLen) n=segLen;
+			httpdRecvCb(&benchConn, BENCH_IP, BENCH_PORT, body+pos, n);
+		}
+	}
+	t=(benchNowNs()-start)/1e9;
+	printf("postbench: %8d byte body in %5d byte segments: %7.1f MB/s (%d cgi calls, checksum %08x)\n",
+			bodyLen, segLen, (double)bodyLen*iters/t/(1024*1024), cgiCalls, sum);
+	free(body);
+	return 0;
+}
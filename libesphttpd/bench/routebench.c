@@ -0,0 +1,71 @@
+/*
+Benchmark for the url lookup in the httpd core. Builds a builtInUrls table with the amount of
+entries given on the command line, then pushes requests through httpdRecvCb on a fake connection
+and reports the time taken per request. Running this for a few table sizes shows how the lookup
+cost scales with the size of the table.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "benchplat.h"
+
+static int cgiBench(HttpdConnData *connData) {
+	if (connData->conn==NULL) return HTTPD_CGI_DONE;
+	httpdStartResponse(connData, 200);
+	httpdEndHeaders(connData);
+	return HTTPD_CGI_DONE;
+}
+
+//Send the request for url iters times and return the average time per request in ns.
+static double benchUrl(const char *url, int iters) {
+	char req[256];
+	int len, i;
+	double start;
+	len=sprintf(req, "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", url);
+	start=benchNowNs();
+	for (i=0; i<iters; i++) {
+		httpdRecvCb(&benchConn, BENCH_IP, BENCH_PORT, req, len);
+	}
+	return (benchNowNs()-start)/iters;
+}
+
+int main(int argc, char **argv) {
+	HttpdBuiltInUrl *urls;
+	char *names;
+	int n, i, iters=200000;
+	char last[64];
+
+	n=(argc>1)?atoi(argv[1]):16;
+	if (argc>2) iters=atoi(argv[2]);
+	if (n<3) n=3;
+
+	//n-2 literal urls, then a wildcard and a catch-all, like a typical builtInUrls table.
+	urls=calloc(n+1, sizeof(HttpdBuiltInUrl));
+	names=malloc(n*32);
+	for (i=0; i<n-2; i++) {
+		sprintf(&names[i*32], "/api/route%d.cgi", i);
+		urls[i].url=&names[i*32];
+		urls[i].cgiCb=cgiBench;
+	}
+	urls[n-2].url="/static/*";
+	urls[n-2].cgiCb=cgiBench;
+	urls[n-1].url="*";
+	urls[n-1].cgiCb=cgiBench;
+
+	if (!httpdInit(urls, 80)) {
+		printf("Couldn't start the httpd\n");
+		return 1;
+	}
+	httpdConnectCb(&benchConn, BENCH_IP, BENCH_PORT);
+
+	sprintf(last, "/api/route%d.cgi", n-3);
+	printf("routebench: %5d urls: first %7.1f ns, last %7.1f ns, wildcard %7.1f ns, catch-all %7.1f ns per request\n",
+			n, benchUrl("/api/route0.cgi", iters), benchUrl(last, iters),
+			benchUrl("/static/img/logo.png", iters), benchUrl("/no/such/file.html", iters));
+	printf("routebench: %d requests, %d heap allocations by the httpd, %lld bytes sent\n",
+			httpdGetStats()->requests, httpdGetStats()->heapAllocs, benchBytesSent);
+	return 0;
+}
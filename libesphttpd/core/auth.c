@@ -19,8 +19,8 @@ HTTP auth implementation. Only does basic authentication for now.
 int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData) {
 	const char *forbidden="401 Forbidden.";
 	int no=0;
-	int r;
-	char hdr[(AUTH_MAX_USER_LEN+AUTH_MAX_PASS_LEN+2)*10];
+	int r, hdrLen;
+	const char *hdr;
 	char userpass[AUTH_MAX_USER_LEN+AUTH_MAX_PASS_LEN+2];
 	char user[AUTH_MAX_USER_LEN];
 	char pass[AUTH_MAX_PASS_LEN];
@@ -29,9 +29,9 @@ int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData) {
 		return HTTPD_CGI_DONE;
 	}
 
-	r=httpdGetHeader(connData, "Authorization", hdr, sizeof(hdr));
-	if (r && strncmp(hdr, "Basic", 5)==0) {
-		r=base64_decode(strlen(hdr)-6, hdr+6, sizeof(userpass), (unsigned char *)userpass);
+	hdr=httpdGetHeaderPtr(connData, "Authorization", &hdrLen);
+	if (hdr!=NULL && hdrLen>6 && strncmp(hdr, "Basic", 5)==0) {
+		r=base64_decode(hdrLen-6, hdr+6, sizeof(userpass)-1, (unsigned char *)userpass);
 		if (r<0) r=0; //just clean out string on decode error
 		userpass[r]=0; //zero-terminate user:pass string
 //		printf("Auth: %s\n", userpass);
@@ -18,11 +18,13 @@ Thanks to my collague at Espressif for writing the foundations of this code.
 #include "freertos/semphr.h"
 
 #include "lwip/lwip/sockets.h"
+#include <errno.h>
 
 
 static int httpPort;
 static int httpMaxConnCt;
 static xQueueHandle httpdMux;
+static xQueueHandle slotMux[HTTPD_MAX_CONNECTIONS];
 
 
 struct  RtosConnType{
@@ -31,13 +33,26 @@ struct  RtosConnType{
 	int needsClose;
 	int port;
 	char ip[4];
+	HttpdConnData *hconn;	//Pool slot the httpd core uses for this connection
 };
 
 static RtosConnType rconn[HTTPD_MAX_CONNECTIONS];
 
+//The sockets are non-blocking, so this takes what fits in the socket buffer and returns straight
+//away. The select loop calls httpdSentCb once the socket is writable again, so the rest can go then.
 int ICACHE_FLASH_ATTR httpdPlatSendData(ConnTypePtr conn, char *buff, int len) {
+	int r;
 	conn->needWriteDoneNotif=1;
-	return (write(conn->fd, buff, len)>=0);
+	r=write(conn->fd, buff, len);
+	if (r<0) {
+		if (errno!=EAGAIN && errno!=EWOULDBLOCK) {
+			//Socket is broken; the writable select code will close it.
+			httpd_printf("platHttpServerTask: write to fd %d failed: %d\n", conn->fd, errno);
+			conn->needsClose=1;
+		}
+		return 0;
+	}
+	return r;
 }
 
 void ICACHE_FLASH_ATTR httpdPlatDisconnect(ConnTypePtr conn) {
@@ -49,6 +64,15 @@ void httpdPlatDisableTimeout(ConnTypePtr conn) {
 	//Unimplemented for FreeRTOS
 }
 
+//Every connection has its own RtosConnType, so the slot can be stored right in there.
+void ICACHE_FLASH_ATTR httpdPlatSetConnData(ConnTypePtr conn, char *remIp, int remPort, HttpdConnData *hconn) {
+	conn->hconn=hconn;
+}
+
+HttpdConnData ICACHE_FLASH_ATTR *httpdPlatGetConnData(ConnTypePtr conn, char *remIp, int remPort) {
+	return conn->hconn;
+}
+
 //Set/clear global httpd lock.
 void ICACHE_FLASH_ATTR httpdPlatLock() {
 	xSemaphoreTakeRecursive(httpdMux, portMAX_DELAY);
@@ -58,8 +82,22 @@ void ICACHE_FLASH_ATTR httpdPlatUnlock() {
 	xSemaphoreGiveRecursive(httpdMux);
 }
 
+//Set/clear the lock of one pool slot. Try without waiting first, so we know if there was contention.
+int ICACHE_FLASH_ATTR httpdPlatLockSlot(int slot) {
+	if (xSemaphoreTakeRecursive(slotMux[slot], 0)==pdTRUE) return 0;
+	xSemaphoreTakeRecursive(slotMux[slot], portMAX_DELAY);
+	return 1;
+}
+
+void ICACHE_FLASH_ATTR httpdPlatUnlockSlot(int slot) {
+	xSemaphoreGiveRecursive(slotMux[slot]);
+}
+
 
 #define RECV_BUF_SIZE 2048
+//Only the server task ever reads from the sockets, so one buffer serves all connections.
+static char recvBuf[RECV_BUF_SIZE];
+
 static void platHttpServerTask(void *pvParameters) {
 	int32 listenfd;
 	int32 remotefd;
@@ -67,15 +105,12 @@ static void platHttpServerTask(void *pvParameters) {
 	int32 ret;
 	int x;
 	int maxfdp = 0;
-	char *precvbuf;
 	fd_set readset,writeset;
 	struct sockaddr name;
 	//struct timeval timeout;
 	struct sockaddr_in server_addr;
 	struct sockaddr_in remote_addr;
 	
-	httpdMux=xSemaphoreCreateRecursiveMutex();
-	
 	for (x=0; x<HTTPD_MAX_CONNECTIONS; x++) {
 		rconn[x].fd=-1;
 	}
@@ -165,10 +200,13 @@ static void platHttpServerTask(void *pvParameters) {
 				setsockopt(remotefd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&keepIdle, sizeof(keepIdle));
 				setsockopt(remotefd, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&keepInterval, sizeof(keepInterval));
 				setsockopt(remotefd, IPPROTO_TCP, TCP_KEEPCNT, (void *)&keepCount, sizeof(keepCount));
+				//Never let a single slow client block the server task.
+				fcntl(remotefd, F_SETFL, fcntl(remotefd, F_GETFL, 0)|O_NONBLOCK);
 				
 				rconn[x].fd=remotefd;
 				rconn[x].needWriteDoneNotif=0;
 				rconn[x].needsClose=0;
+				rconn[x].hconn=NULL;
 				
 				len=sizeof(name);
 				getpeername(remotefd, &name, (socklen_t *)&len);
@@ -204,24 +242,18 @@ static void platHttpServerTask(void *pvParameters) {
 				}
 
 				if (FD_ISSET(rconn[x].fd, &readset)) {
-					precvbuf=(char*)malloc(RECV_BUF_SIZE);
-					if (precvbuf==NULL) {
-						httpd_printf("platHttpServerTask: memory exhausted!\n");
-						httpdDisconCb(&rconn[x], rconn[x].ip, rconn[x].port);
-						close(rconn[x].fd);
-						rconn[x].fd=-1;
-					}
-					ret=recv(rconn[x].fd, precvbuf, RECV_BUF_SIZE,0);
+					ret=recv(rconn[x].fd, recvBuf, RECV_BUF_SIZE,0);
 					if (ret > 0) {
 						//Data received. Pass to httpd.
-						httpdRecvCb(&rconn[x], rconn[x].ip, rconn[x].port, precvbuf, ret);
+						httpdRecvCb(&rconn[x], rconn[x].ip, rconn[x].port, recvBuf, ret);
+					} else if (ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+						//Nothing there after all.
 					} else {
 						//recv error,connection close
 						httpdDisconCb(&rconn[x], rconn[x].ip, rconn[x].port);
 						close(rconn[x].fd);
 						rconn[x].fd=-1;
 					}
-					if (precvbuf) free(precvbuf);
 				}
 			}
 		}
@@ -253,8 +285,12 @@ static void platHttpServerTask(void *pvParameters) {
 
 //Initialize listening socket, do general initialization
 void ICACHE_FLASH_ATTR httpdPlatInit(int port, int maxConnCt) {
+	int x;
 	httpPort=port;
 	httpMaxConnCt=maxConnCt;
+	//Create the locks here instead of in the task: other tasks may use them as soon as we return.
+	httpdMux=xSemaphoreCreateRecursiveMutex();
+	for (x=0; x<HTTPD_MAX_CONNECTIONS; x++) slotMux[x]=xSemaphoreCreateRecursiveMutex();
 #ifdef ESP32
 	xTaskCreate(platHttpServerTask, (const char *)"esphttpd", HTTPD_STACKSIZE, NULL, 4, NULL);
 #else
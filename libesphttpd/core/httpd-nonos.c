@@ -7,7 +7,7 @@ ESP8266 web server - platform-dependent routines, nonos version
 #include "platform.h"
 #include "httpd-platform.h"
 
-#ifndef FREERTOS
+#if !defined(FREERTOS) && !defined(HTTPD_POSIX)
 
 //Listening connection data
 static struct espconn httpdConn;
@@ -20,6 +20,51 @@ void ICACHE_FLASH_ATTR httpdPlatLock() {
 void ICACHE_FLASH_ATTR httpdPlatUnlock() {
 }
 
+//Same for the per-slot locks; there's only one thread so they never have to wait.
+int ICACHE_FLASH_ATTR httpdPlatLockSlot(int slot) {
+	return 0;
+}
+void ICACHE_FLASH_ATTR httpdPlatUnlockSlot(int slot) {
+}
+
+//The SDK doesn't always pass the same espconn to the callbacks of one connection, so the pool
+//slots are found by remote ip and port instead, through a small chained hash map. Chains are
+//linked through connMapNext, which is indexed by slot.
+#define CONNMAP_BUCKETS (HTTPD_MAX_CONNECTIONS*2)
+static HttpdConnData *connMap[CONNMAP_BUCKETS];
+static HttpdConnData *connMapNext[HTTPD_MAX_CONNECTIONS];
+
+static int ICACHE_FLASH_ATTR connMapBucket(char *remIp, int remPort) {
+	unsigned int h=remPort;
+	int i;
+	for (i=0; i<4; i++) h=h*31+(uint8_t)remIp[i];
+	return h%CONNMAP_BUCKETS;
+}
+
+void ICACHE_FLASH_ATTR httpdPlatSetConnData(ConnTypePtr conn, char *remIp, int remPort, HttpdConnData *hconn) {
+	HttpdConnData **p=&connMap[connMapBucket(remIp, remPort)];
+	//Unlink whatever slot is registered for this ip/port now.
+	while (*p!=NULL) {
+		if ((*p)->remote_port==remPort && memcmp((*p)->remote_ip, remIp, 4)==0) {
+			*p=connMapNext[(*p)->slot];
+			break;
+		}
+		p=&connMapNext[(*p)->slot];
+	}
+	if (hconn==NULL) return;
+	p=&connMap[connMapBucket(remIp, remPort)];
+	connMapNext[hconn->slot]=*p;
+	*p=hconn;
+}
+
+HttpdConnData ICACHE_FLASH_ATTR *httpdPlatGetConnData(ConnTypePtr conn, char *remIp, int remPort) {
+	HttpdConnData *hconn=connMap[connMapBucket(remIp, remPort)];
+	while (hconn!=NULL && (hconn->remote_port!=remPort || memcmp(hconn->remote_ip, remIp, 4)!=0)) {
+		hconn=connMapNext[hconn->slot];
+	}
+	return hconn;
+}
+
 
 static void ICACHE_FLASH_ATTR platReconCb(void *arg, sint8 err) {
 	//From ESP8266 SDK
@@ -60,8 +105,9 @@ static void ICACHE_FLASH_ATTR platConnCb(void *arg) {
 
 int ICACHE_FLASH_ATTR httpdPlatSendData(ConnTypePtr conn, char *buff, int len) {
 	int r;
+	//espconn_sent takes everything or nothing.
 	r=espconn_sent(conn, (uint8_t*)buff, len);
-	return (r>=0);
+	return (r>=0)?len:0;
 }
 
 void ICACHE_FLASH_ATTR httpdPlatDisconnect(ConnTypePtr conn) {
@@ -4,12 +4,23 @@ extern "C" {
 #ifndef HTTPD_PLATFORM_H
 #define HTTPD_PLATFORM_H
 
+//Returns the amount of bytes the platform accepted, which can be less than len (even 0) if it
+//can't take more right now. The core keeps the rest and retries when httpdSentCb is called.
 int httpdPlatSendData(ConnTypePtr conn, char *buff, int len);
 void httpdPlatDisconnect(ConnTypePtr conn);
 void httpdPlatDisableTimeout(ConnTypePtr conn);
 void httpdPlatInit(int port, int maxConnCt);
+//Global lock; only held briefly by the core, to allocate and free pool slots.
 void httpdPlatLock();
 void httpdPlatUnlock();
+//Per-slot locks; recursive. The slot lock is taken before the global lock, never after it.
+//httpdPlatLockSlot returns non-zero if it had to wait for another task to release the lock.
+int httpdPlatLockSlot(int slot);
+void httpdPlatUnlockSlot(int slot);
+//The platform keeps the pool slot of each connection, so the callbacks can find it without a search.
+//hconn==NULL means the connection no longer has a slot.
+void httpdPlatSetConnData(ConnTypePtr conn, char *remIp, int remPort, HttpdConnData *hconn);
+HttpdConnData *httpdPlatGetConnData(ConnTypePtr conn, char *remIp, int remPort);
 
 #endif
 #ifdef __cplusplus
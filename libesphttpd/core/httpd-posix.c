@@ -0,0 +1,291 @@
+/*
+ESP8266 web server - platform-dependent routines, POSIX version
+
+This runs the httpd on a Linux machine, using epoll. It's not meant to replace a real web server:
+it's there so the httpd core can be benchmarked and debugged on a PC. It works the same way as the
+FreeRTOS version: one server thread handles all sockets, other threads can use the
+httpdConnSendStart/httpdConnSendFinish functions to push data to a connection.
+*/
+#ifdef HTTPD_POSIX
+//For accept4 and pipe2
+#define _GNU_SOURCE
+
+#include <esp8266.h>
+#include "httpd.h"
+#include "platform.h"
+#include "httpd-platform.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct PosixConnType {
+	int fd;
+	int needWriteDoneNotif;	//Set from any thread, so only accessed atomically
+	int needsClose;			//Same
+	int port;
+	char ip[4];
+	int events;				//Events epoll currently watches for on this fd
+	HttpdConnData *hconn;	//Pool slot the httpd core uses for this connection
+};
+
+//epoll_event.data.u32 values for the fds that aren't connections
+#define ID_LISTEN HTTPD_MAX_CONNECTIONS
+#define ID_WAKE (HTTPD_MAX_CONNECTIONS+1)
+
+static PosixConnType rconn[HTTPD_MAX_CONNECTIONS];
+static int listenFd=-1;
+static int listenEvents;
+static int epollFd=-1;
+static int wakePipe[2];
+static pthread_t serverThread;
+static pthread_mutex_t httpdMux;
+static pthread_mutex_t slotMux[HTTPD_MAX_CONNECTIONS];
+
+//Make sure the server thread looks at the connection again. When called from another thread, the
+//server thread may be sleeping in epoll_wait with an outdated event mask, so wake it up.
+static void ICACHE_FLASH_ATTR platWantWrite(ConnTypePtr conn) {
+	__atomic_store_n(&conn->needWriteDoneNotif, 1, __ATOMIC_SEQ_CST);
+	if (!pthread_equal(pthread_self(), serverThread)) {
+		if (write(wakePipe[1], "", 1)<0) {
+			//Pipe full: the server thread has plenty of wakeups pending already.
+		}
+	}
+}
+
+int ICACHE_FLASH_ATTR httpdPlatSendData(ConnTypePtr conn, char *buff, int len) {
+	int r;
+	platWantWrite(conn);
+	r=send(conn->fd, buff, len, MSG_NOSIGNAL);
+	if (r<0) {
+		if (errno!=EAGAIN && errno!=EWOULDBLOCK) {
+			//Socket is broken; the writable code in the server thread will close it.
+			httpd_printf("platHttpServerTask: send to fd %d failed: %s\n", conn->fd, strerror(errno));
+			__atomic_store_n(&conn->needsClose, 1, __ATOMIC_SEQ_CST);
+		}
+		return 0;
+	}
+	return r;
+}
+
+void ICACHE_FLASH_ATTR httpdPlatDisconnect(ConnTypePtr conn) {
+	__atomic_store_n(&conn->needsClose, 1, __ATOMIC_SEQ_CST);
+	platWantWrite(conn); //because the real close is done in the writable code
+}
+
+void ICACHE_FLASH_ATTR httpdPlatDisableTimeout(ConnTypePtr conn) {
+	//There are no timeouts here.
+}
+
+void ICACHE_FLASH_ATTR httpdPlatSetConnData(ConnTypePtr conn, char *remIp, int remPort, HttpdConnData *hconn) {
+	conn->hconn=hconn;
+}
+
+HttpdConnData ICACHE_FLASH_ATTR *httpdPlatGetConnData(ConnTypePtr conn, char *remIp, int remPort) {
+	return conn->hconn;
+}
+
+//Set/clear global httpd lock.
+void ICACHE_FLASH_ATTR httpdPlatLock() {
+	pthread_mutex_lock(&httpdMux);
+}
+
+void ICACHE_FLASH_ATTR httpdPlatUnlock() {
+	pthread_mutex_unlock(&httpdMux);
+}
+
+//Set/clear the lock of one pool slot. Try without waiting first, so we know if there was contention.
+int ICACHE_FLASH_ATTR httpdPlatLockSlot(int slot) {
+	if (pthread_mutex_trylock(&slotMux[slot])==0) return 0;
+	pthread_mutex_lock(&slotMux[slot]);
+	return 1;
+}
+
+void ICACHE_FLASH_ATTR httpdPlatUnlockSlot(int slot) {
+	pthread_mutex_unlock(&slotMux[slot]);
+}
+
+//Change the events epoll watches for on an fd, if they're different from what they are now.
+static void ICACHE_FLASH_ATTR platSetEvents(int fd, int *curEvents, int events, uint32_t id) {
+	struct epoll_event ev;
+	if (*curEvents==events) return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.u32=id;
+	epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+	*curEvents=events;
+}
+
+static void ICACHE_FLASH_ATTR platClose(int x) {
+	httpdDisconCb(&rconn[x], rconn[x].ip, rconn[x].port);
+	close(rconn[x].fd); //also removes it from the epoll set
+	rconn[x].fd=-1;
+}
+
+static void ICACHE_FLASH_ATTR platAccept() {
+	struct sockaddr_in remote_addr;
+	socklen_t len=sizeof(remote_addr);
+	struct epoll_event ev;
+	int remotefd, x, one=1;
+
+	remotefd=accept4(listenFd, (struct sockaddr *)&remote_addr, &len, SOCK_NONBLOCK);
+	if (remotefd<0) return;
+	for (x=0; x<HTTPD_MAX_CONNECTIONS; x++) if (rconn[x].fd==-1) break;
+	if (x==HTTPD_MAX_CONNECTIONS) {
+		httpd_printf("platHttpServerTask: Huh? Got accept with all slots full.\n");
+		close(remotefd);
+		return;
+	}
+	//The httpd sends a response in a few pieces; don't let Nagle hold back the last one.
+	setsockopt(remotefd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	rconn[x].fd=remotefd;
+	rconn[x].needWriteDoneNotif=0;
+	rconn[x].needsClose=0;
+	rconn[x].hconn=NULL;
+	rconn[x].port=ntohs(remote_addr.sin_port);
+	memcpy(rconn[x].ip, &remote_addr.sin_addr.s_addr, sizeof(rconn[x].ip));
+	rconn[x].events=EPOLLIN;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=EPOLLIN;
+	ev.data.u32=x;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, remotefd, &ev);
+
+	if (!httpdConnectCb(&rconn[x], rconn[x].ip, rconn[x].port)) {
+		close(remotefd);
+		rconn[x].fd=-1;
+	}
+}
+
+#define RECV_BUF_SIZE 2048
+//Only the server thread ever reads from the sockets, so one buffer serves all connections.
+static char recvBuf[RECV_BUF_SIZE];
+
+static void *platHttpServerTask(void *pvParameters) {
+	struct epoll_event ev[HTTPD_MAX_CONNECTIONS+2];
+	int x, i, n, ret, socketsFull;
+	char dummy[64];
+
+	httpd_printf("esphttpd: active and listening to connections.\n");
+	while(1) {
+		//Watch for writability only on the connections that wait for a 'sent' notification, and
+		//only accept connections when there's a free slot.
+		socketsFull=1;
+		for (x=0; x<HTTPD_MAX_CONNECTIONS; x++) {
+			if (rconn[x].fd==-1) {
+				socketsFull=0;
+				continue;
+			}
+			platSetEvents(rconn[x].fd, &rconn[x].events,
+					__atomic_load_n(&rconn[x].needWriteDoneNotif, __ATOMIC_SEQ_CST)?(EPOLLIN|EPOLLOUT):EPOLLIN, x);
+		}
+		platSetEvents(listenFd, &listenEvents, socketsFull?0:EPOLLIN, ID_LISTEN);
+
+		n=epoll_wait(epollFd, ev, HTTPD_MAX_CONNECTIONS+2, -1);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+		for (i=0; i<n; i++) {
+			x=ev[i].data.u32;
+			if (x==ID_LISTEN) {
+				platAccept();
+				continue;
+			}
+			if (x==ID_WAKE) {
+				//Only there to get us out of epoll_wait; the loop above does the real work.
+				while (read(wakePipe[0], dummy, sizeof(dummy))>0) ;
+				continue;
+			}
+			if (rconn[x].fd==-1) continue;
+
+			//Check for write availability first: the read routines may set needWriteDoneNotif
+			//while epoll didn't check for that.
+			if ((ev[i].events&(EPOLLOUT|EPOLLERR|EPOLLHUP)) &&
+					__atomic_exchange_n(&rconn[x].needWriteDoneNotif, 0, __ATOMIC_SEQ_CST)) {
+				//Cleared first: httpdSentCb may write something making this 1 again.
+				if (__atomic_load_n(&rconn[x].needsClose, __ATOMIC_SEQ_CST)) {
+					platClose(x);
+					continue;
+				}
+				httpdSentCb(&rconn[x], rconn[x].ip, rconn[x].port);
+			}
+
+			if (ev[i].events&(EPOLLIN|EPOLLERR|EPOLLHUP)) {
+				ret=recv(rconn[x].fd, recvBuf, RECV_BUF_SIZE, 0);
+				if (ret>0) {
+					//Data received. Pass to httpd.
+					httpdRecvCb(&rconn[x], rconn[x].ip, rconn[x].port, recvBuf, ret);
+				} else if (ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+					//Nothing there after all.
+				} else {
+					//recv error, connection close
+					platClose(x);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+//Initialize listening socket, do general initialization. Unlike on the ESP, failing to get the
+//port is something that can happen on a PC, so that's reported.
+void ICACHE_FLASH_ATTR httpdPlatInit(int port, int maxConnCt) {
+	struct sockaddr_in server_addr;
+	struct epoll_event ev;
+	pthread_mutexattr_t attr;
+	int x, one=1;
+
+	//Locks are recursive, like the FreeRTOS ones.
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&httpdMux, &attr);
+	for (x=0; x<HTTPD_MAX_CONNECTIONS; x++) {
+		pthread_mutex_init(&slotMux[x], &attr);
+		rconn[x].fd=-1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	listenFd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	if (listenFd<0) {
+		perror("httpdPlatInit: socket");
+		return;
+	}
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family=AF_INET;
+	server_addr.sin_addr.s_addr=htonl(INADDR_ANY);
+	server_addr.sin_port=htons(port);
+	if (bind(listenFd, (struct sockaddr *)&server_addr, sizeof(server_addr))!=0 ||
+			listen(listenFd, HTTPD_MAX_CONNECTIONS)!=0) {
+		perror("httpdPlatInit: bind/listen");
+		close(listenFd);
+		listenFd=-1;
+		return;
+	}
+
+	epollFd=epoll_create1(0);
+	if (epollFd<0 || pipe2(wakePipe, O_NONBLOCK)!=0) {
+		perror("httpdPlatInit: epoll/pipe");
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events=EPOLLIN;
+	ev.data.u32=ID_LISTEN;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+	listenEvents=EPOLLIN;
+	ev.data.u32=ID_WAKE;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakePipe[0], &ev);
+
+	pthread_create(&serverThread, NULL, platHttpServerTask, NULL);
+}
+
+#endif
@@ -15,18 +15,29 @@ Esp8266 http server - core routines
 #include <esp8266.h>
 #include "httpd.h"
 #include "httpd-platform.h"
+#include "httpd-mime.h"
 #include <string.h>
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
 
-typedef struct HttpSendBacklogItem HttpSendBacklogItem;
-
-struct HttpSendBacklogItem {
-	int len;
-	HttpSendBacklogItem *next;
-	char data[];
-};
+//Compiled form of builtInUrls, so a request doesn't need a pass over the whole table. Literal
+//patterns are hashed on the full url, wildcard patterns on the part before the '*'. Every bucket
+//is a chain of table entries in table order, so the first match still is the first entry in
+//the table that matches.
+typedef struct {
+	uint32_t hash;		//Hash of the pattern, without the '*' for wildcards
+	int16_t next;		//Next entry in the same bucket, or -1
+	uint16_t len;		//Length of the pattern, without the '*' for wildcards
+	uint8_t wild;		//1 if the pattern ends in a '*'
+} HttpdRoute;
+
+static HttpdRoute *routes;
+static int16_t *routeBuckets;
+static int routeBucketMask;
+//Sorted, unique lengths of all wildcard prefixes. Only url prefixes of these lengths need checking.
+static uint16_t *routeWildLens;
+static int routeWildLenCt;
 
 //Flags
 #define HFL_HTTP11 (1<<0)
@@ -34,47 +45,86 @@ struct HttpSendBacklogItem {
 #define HFL_SENDINGBODY (1<<2)
 #define HFL_DISCONAFTERSENT (1<<3)
 #define HFL_NOCONNECTIONSTR (1<<4)
+#define HFL_HEADDONE (1<<5)
+#define HFL_CONTENTLEN (1<<6)	//Keep-alive, with the body length sent in a Content-Length header
+#define HFL_PIPEFULL (1<<7)		//Pipelined requests were dropped; close after this response
+#define HFL_SENDDROPPED (1<<8)	//Backlog overflowed; the response is broken, so send nothing more
+#define HFL_SENDHELD (1<<9)		//No backlog buffer was free; unsent data is held in sendBuff instead
+
+//Parameters for the FNV-1a hash used for url and header lookups.
+#define FNV_BASIS 2166136261UL
+#define FNV_PRIME 16777619UL
+
+//Size of the header index hash table. Needs to be a power of two and larger than HTTPD_MAX_HEADERS.
+#define HTTPD_HEADER_BUCKETS 64
+
+//Index entry for one request header. Offsets are relative to the start of the head.
+typedef struct {
+	uint32_t hash;		//Hash of the lower-case header name
+	uint16_t name;		//Offset of the header name
+	uint16_t nameLen;
+	uint16_t value;		//Offset of the (zero-terminated) value
+	uint16_t valueLen;
+} HttpdHeaderIdx;
 
 //Private data for http connection
 struct HttpdPriv {
 	char head[HTTPD_MAX_HEAD_LEN];
 	int headPos;
-	char *sendBuff;
+	int headLineStart;	//Offset in head of the header line currently being received
+	HttpdHeaderIdx hdrs[HTTPD_MAX_HEADERS];
+	int hdrCount;
+	int8_t hdrBucket[HTTPD_HEADER_BUCKETS];	//Index in hdrs, or -1 if empty
+	//Word aligned, so data read from flash with httpdSendReserve lands on word boundaries.
+	char sendBuff[HTTPD_MAX_SENDBUFF_LEN] __attribute__((aligned(4)));
 	int sendBuffLen;
 	char *chunkHdr;
-	HttpSendBacklogItem *sendBacklog;
-	int sendBacklogSize;
+	char *sendBacklog;		//Ring buffer of data the platform didn't accept yet, from backlogPool; NULL if none
+	int sendBacklogPos;		//Offset of the oldest byte in sendBacklog
+	int sendBacklogSize;	//Amount of bytes in sendBacklog
+	char *pipeBuf;			//Pipelined requests waiting for the current one to finish, from pipePool; NULL if none
+	int pipeLen;
+	int contentLen;		//Body length set by httpdSetContentLength, or -1 if not known
+	int bodySent;		//Body bytes the cgi sent so far
 	int flags;
 };
 
 
-//Connection pool
-static HttpdConnData *connData[HTTPD_MAX_CONNECTIONS];
+//What every connection needs, in one block. These get allocated for all slots at once by
+//httpdInit and are re-used for every connection that lands in the slot.
+typedef struct {
+	HttpdConnData conn;
+	HttpdPriv priv;
+	HttpdPostData post;
+} HttpdSlot;
 
-//Struct to keep extension->mime data in
+static HttpdSlot *slots;
+
+#if HTTPD_SHARED_BUFFERS<1
+#error HTTPD_SHARED_BUFFERS needs to be at least 1
+#endif
+
+//Buffers only some connections need some of the time are shared between them. A buffer gets
+//allocated the first time it's needed and is kept for re-use afterwards, so after the busiest moment
+//handling requests doesn't need the heap anymore.
 typedef struct {
-	const char *ext;
-	const char *mimetype;
-} MimeMap;
+	int size;
+	char *buf[HTTPD_SHARED_BUFFERS];
+	char used[HTTPD_SHARED_BUFFERS];
+} HttpdBufPool;
+
+static HttpdBufPool postPool={HTTPD_MAX_POST_LEN+1};
+static HttpdBufPool backlogPool={HTTPD_MAX_BACKLOG_SIZE};
+static HttpdBufPool pipePool={HTTPD_MAX_PIPELINE_LEN};
 
+//Connection pool. Points to the conn in the corresponding slot if in use, NULL otherwise.
+static HttpdConnData *connData[HTTPD_MAX_CONNECTIONS];
 
-//#define RSTR(a) ((const char)(a))
+static HttpdStats stats;
 
-//The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
+//The mappings from file extensions to mime types; add extra ones to httpd-mime.h.
 static const ICACHE_RODATA_ATTR MimeMap mimeTypes[]={
-	{"htm", "text/htm"},
-	{"html", "text/html"},
-	{"css", "text/css"},
-	{"js", "text/javascript"},
-	{"txt", "text/plain"},
-	{"jpg", "image/jpeg"},
-	{"jpeg", "image/jpeg"},
-	{"png", "image/png"},
-	{"svg", "image/svg+xml"},
-	{"xml", "text/xml"},
-	{"json", "application/json"},
-	{NULL, "text/html"}, //default value
+	HTTPD_MIME_TYPES
 };
 
 //Returns a static char* to a mime type for a given url to a file.
@@ -90,14 +140,39 @@ const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
 	return mimeTypes[i].mimetype;
 }
 
+//Bump one of the stats counters. Connections handled by different tasks bump them at the same time,
+//so this takes the global lock.
+static void ICACHE_FLASH_ATTR httpdCount(unsigned int *counter) {
+	httpdPlatLock();
+	(*counter)++;
+	httpdPlatUnlock();
+}
+
 //Looks up the connData info for a specific connection
+//Locking: every pool slot has its own lock, which is held while the connection is handled or sent
+//to, so a slow cgi or an application task sending on one connection doesn't hold up the others.
+//The global httpdPlatLock protects what's shared between connections: the slot allocation (connData[]),
+//the shared buffer pools, the stats counters and the websocket list. It's only held briefly. Lock ordering: a slot lock may be held while taking the global lock, never the other
+//way around, and nothing may hold the locks of two slots at the same time.
+static void ICACHE_FLASH_ATTR httpdLockSlot(int slot) {
+	//Had to wait for another task to release it? Count that.
+	if (httpdPlatLockSlot(slot)) httpdCount(&stats.lockWaits);
+}
+
+//Finds the pool slot for a connection and locks it. Returns NULL, without holding any lock, if the
+//connection is unknown. Otherwise the caller needs to httpdPlatUnlockSlot it when done.
 static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(ConnTypePtr conn, char *remIp, int remPort) {
-	for (int i=0; i<HTTPD_MAX_CONNECTIONS; i++) {
-		if (connData[i] && connData[i]->remote_port == remPort &&
-						memcmp(connData[i]->remote_ip, remIp, 4) == 0) {
-			connData[i]->conn=conn;
-			return connData[i];
+	//The platform hands us the slot it stored at connect time. Check it still is the connection
+	//we're asked about (it may have been retired while we waited for the lock) before trusting it.
+	HttpdConnData *hconn=httpdPlatGetConnData(conn, remIp, remPort);
+	if (hconn!=NULL) {
+		httpdLockSlot(hconn->slot);
+		if (connData[hconn->slot]==hconn && hconn->remote_port==remPort &&
+						memcmp(hconn->remote_ip, remIp, 4)==0) {
+			hconn->conn=conn;
+			return hconn;
 		}
+		httpdPlatUnlockSlot(hconn->slot);
 	}
 	//Shouldn't happen.
 	httpd_printf("*** Unknown connection %d.%d.%d.%d:%d\n", remIp[0]&0xff, remIp[1]&0xff, remIp[2]&0xff, remIp[3]&0xff, remPort);
@@ -105,24 +180,68 @@ static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(ConnTypePtr conn, char
 	return NULL;
 }
 
-//Retires a connection for re-use
-static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
-	if (conn->priv->sendBacklog!=NULL) {
-		HttpSendBacklogItem *i, *j;
-		i=conn->priv->sendBacklog;
-		do {
-			j=i;
-			i=i->next;
-			free(j);
-		} while (i!=NULL);
+//Takes a buffer from a pool. Returns NULL if they're all in use, or there's no memory for a new one.
+static char ICACHE_FLASH_ATTR *httpdBufGet(HttpdBufPool *pool) {
+	int i;
+	char *ret=NULL;
+	httpdPlatLock();
+	//Prefer a buffer that already exists over allocating a new one.
+	for (i=0; i<HTTPD_SHARED_BUFFERS; i++) {
+		if (pool->buf[i]!=NULL && !pool->used[i]) break;
+	}
+	if (i==HTTPD_SHARED_BUFFERS) {
+		for (i=0; i<HTTPD_SHARED_BUFFERS; i++) {
+			if (pool->buf[i]==NULL) break;
+		}
+		if (i<HTTPD_SHARED_BUFFERS) {
+			pool->buf[i]=malloc(pool->size);
+			stats.heapAllocs++;
+			if (pool->buf[i]==NULL) i=HTTPD_SHARED_BUFFERS;
+		}
 	}
-	if (conn->post->buff!=NULL) free(conn->post->buff);
-	if (conn->post!=NULL) free(conn->post);
-	if (conn->priv!=NULL) free(conn->priv);
-	if (conn) free(conn);
-	for (int i=0; i<HTTPD_MAX_CONNECTIONS; i++) {
-		if (connData[i]==conn) connData[i]=NULL;
+	if (i<HTTPD_SHARED_BUFFERS) {
+		pool->used[i]=1;
+		ret=pool->buf[i];
+	}
+	httpdPlatUnlock();
+	return ret;
+}
+
+//Returns a buffer from httpdBufGet to its pool. buf may be NULL.
+static void ICACHE_FLASH_ATTR httpdBufPut(HttpdBufPool *pool, char *buf) {
+	int i;
+	if (buf==NULL) return;
+	httpdPlatLock();
+	for (i=0; i<HTTPD_SHARED_BUFFERS; i++) {
+		if (pool->buf[i]==buf) pool->used[i]=0;
 	}
+	httpdPlatUnlock();
+}
+
+//Retires a connection for re-use
+static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn, ConnTypePtr rconn) {
+	//Anything still in the backlog can't be sent anymore. Give the shared buffers back.
+	httpdBufPut(&backlogPool, conn->priv->sendBacklog);
+	conn->priv->sendBacklog=NULL;
+	conn->priv->sendBacklogPos=0;
+	conn->priv->sendBacklogSize=0;
+	httpdBufPut(&pipePool, conn->priv->pipeBuf);
+	conn->priv->pipeBuf=NULL;
+	conn->priv->pipeLen=0;
+	httpdBufPut(&postPool, conn->post->buff);
+	conn->post->buff=NULL;
+	httpdPlatSetConnData(rconn, (char*)conn->remote_ip, conn->remote_port, NULL);
+	//Tasks that still have a pointer to this connection must not send to whatever lands in the slot next.
+	conn->gen++;
+	//The slot memory itself stays allocated; it will be re-used for the next connection.
+	httpdPlatLock();
+	connData[conn->slot]=NULL;
+	httpdPlatUnlock();
+}
+
+//Returns the statistics the httpd keeps.
+const HttpdStats ICACHE_FLASH_ATTR *httpdGetStats() {
+	return &stats;
 }
 
 //Stupid li'l helper function that returns the value of a hex char.
@@ -186,33 +305,92 @@ int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLe
 	return -1; //not found
 }
 
-//Get the value of a certain header in the HTTP client head
-//Returns true when found, false when not found.
-int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
-	char *p=conn->priv->head;
-	p=p+strlen(p)+1; //skip GET/POST part
-	p=p+strlen(p)+1; //skip HTTP part
-	while (p<(conn->priv->head+conn->priv->headPos)) {
-		while(*p<=32 && *p!=0) p++; //skip crap at start
-		//See if this is the header
-		if (strncmp(p, header, strlen(header))==0 && p[strlen(header)]==':') {
-			//Skip 'key:' bit of header line
-			p=p+strlen(header)+1;
-			//Skip past spaces after the colon
-			while(*p==' ') p++;
-			//Copy from p to end
-			while (*p!=0 && *p!='\r' && *p!='\n' && retLen>1) {
-				*ret++=*p++;
-				retLen--;
-			}
-			//Zero-terminate string
-			*ret=0;
-			//All done :)
-			return 1;
+static char ICACHE_FLASH_ATTR httpdLowerCase(char c) {
+	if (c>='A' && c<='Z') return c+('a'-'A');
+	return c;
+}
+
+//Hash of a header name. Header names are case-insensitive, so this hashes the lower-case version.
+static uint32_t ICACHE_FLASH_ATTR httpdHeaderHash(const char *name, int len) {
+	uint32_t h=FNV_BASIS;
+	while (len--) h=(h^(uint8_t)httpdLowerCase(*name++))*FNV_PRIME;
+	return h;
+}
+
+//Case-insensitive compare of len bytes of two header names. Returns 1 if they're the same.
+static int ICACHE_FLASH_ATTR httpdHeaderNameEq(const char *a, const char *b, int len) {
+	while (len--) {
+		if (httpdLowerCase(*a++)!=httpdLowerCase(*b++)) return 0;
+	}
+	return 1;
+}
+
+//Add the header line at offset line in the head to the header index.
+static void ICACHE_FLASH_ATTR httpdIndexHeader(HttpdPriv *priv, int line) {
+	char *h=&priv->head[line];
+	char *v=h;
+	int b;
+	HttpdHeaderIdx *hi;
+	while (*v!=':' && *v!=0) v++;
+	if (*v==0 || v==h) return; //Not a header line
+	if (priv->hdrCount==HTTPD_MAX_HEADERS) {
+		httpd_printf("Httpd: too many headers, ignoring %s\n", h);
+		return;
+	}
+	hi=&priv->hdrs[priv->hdrCount];
+	hi->nameLen=v-h;
+	hi->hash=httpdHeaderHash(h, hi->nameLen);
+	hi->name=line;
+	v++;
+	while (*v==' ') v++;
+	hi->value=v-priv->head;
+	hi->valueLen=strlen(v);
+	//Insert in the hash table using linear probing. A duplicate header ends up further along the
+	//probe sequence than the first one, so a lookup returns the first one, like it always did.
+	b=hi->hash&(HTTPD_HEADER_BUCKETS-1);
+	while (priv->hdrBucket[b]!=-1) b=(b+1)&(HTTPD_HEADER_BUCKETS-1);
+	priv->hdrBucket[b]=priv->hdrCount++;
+}
+
+//Forget all indexed headers, for when a new request comes in.
+static void ICACHE_FLASH_ATTR httpdResetHeaderIndex(HttpdPriv *priv) {
+	priv->hdrCount=0;
+	memset(priv->hdrBucket, -1, sizeof(priv->hdrBucket));
+}
+
+//Get a pointer to the value of a certain header in the HTTP client head, without copying it.
+//The value is zero-terminated; its length is stored in len if that isn't NULL. Returns NULL if
+//the header wasn't sent. The pointer is valid until the request is done.
+const char ICACHE_FLASH_ATTR *httpdGetHeaderPtr(HttpdConnData *conn, const char *header, int *len) {
+	HttpdPriv *priv=conn->priv;
+	int nameLen=strlen(header);
+	uint32_t hash=httpdHeaderHash(header, nameLen);
+	int b=hash&(HTTPD_HEADER_BUCKETS-1);
+	HttpdHeaderIdx *hi;
+	while (priv->hdrBucket[b]!=-1) {
+		hi=&priv->hdrs[(int)priv->hdrBucket[b]];
+		if (hi->hash==hash && hi->nameLen==nameLen && httpdHeaderNameEq(&priv->head[hi->name], header, nameLen)) {
+			if (len) *len=hi->valueLen;
+			return &priv->head[hi->value];
 		}
-		p+=strlen(p)+1; //Skip past end of string and \0 terminator
+		b=(b+1)&(HTTPD_HEADER_BUCKETS-1);
 	}
-	return 0;
+	return NULL;
+}
+
+//Get the value of a certain header in the HTTP client head
+//Returns true when found, false when not found or when ret has no room for the terminating zero.
+int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+	int len;
+	const char *p;
+	if (retLen<1) return 0;
+	p=httpdGetHeaderPtr(conn, header, &len);
+	if (p==NULL) return 0;
+	if (len>retLen-1) len=retLen-1;
+	memcpy(ret, p, len);
+	//Zero-terminate string
+	ret[len]=0;
+	return 1;
 }
 
 void ICACHE_FLASH_ATTR httdSetTransferMode(HttpdConnData *conn, int mode) {
@@ -228,20 +406,68 @@ void ICACHE_FLASH_ATTR httdSetTransferMode(HttpdConnData *conn, int mode) {
 	}
 }
 
-//Start the response headers.
-void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
+//Tell the httpd the length of the body the cgi is about to send. Call this before
+//httpdStartResponse. The response then gets a Content-Length header instead of chunked encoding,
+//and the connection can still be kept alive afterwards. The cgi must send exactly len bytes.
+void ICACHE_FLASH_ATTR httpdSetContentLength(HttpdConnData *conn, int len) {
+	conn->priv->contentLen=len;
+	if (conn->priv->flags&HFL_CHUNKED) {
+		//Client can do keep-alive; the length takes over the job of the chunking.
+		conn->priv->flags&=~HFL_CHUNKED;
+		conn->priv->flags|=HFL_CONTENTLEN;
+	}
+}
+
+//Reason phrase for the status line. Codes that aren't listed keep the "OK" they always got.
+static const char ICACHE_FLASH_ATTR *httpdStatusText(int code) {
+	switch (code) {
+	case 206: return "Partial Content";
+	case 304: return "Not Modified";
+	case 416: return "Range Not Satisfiable";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default: return "OK";
+	}
+}
+
+//Send the status line and the headers the httpd is responsible for. Content-Length is left out if
+//lenHeader is 0.
+static void ICACHE_FLASH_ATTR httpdSendStatus(HttpdConnData *conn, int code, int lenHeader) {
 	char buff[256];
 	int l;
 	const char *connStr="Connection: close\r\n";
+	//A 304 never has a body, so there's nothing to chunk and it doesn't get a Content-Length
+	//either; that would describe the entity the client already has.
+	if (code==304) {
+		httpdSetContentLength(conn, 0);
+		lenHeader=0;
+	}
 	if (conn->priv->flags&HFL_CHUNKED) connStr="Transfer-Encoding: chunked\r\n";
+	if (conn->priv->flags&HFL_CONTENTLEN) connStr=""; //keep-alive is the default for HTTP/1.1
 	if (conn->priv->flags&HFL_NOCONNECTIONSTR) connStr="";
-	l=sprintf(buff, "HTTP/1.%d %d OK\r\nServer: esp8266-httpd/"HTTPDVER"\r\n%s", 
+	l=sprintf(buff, "HTTP/1.%d %d %s\r\nServer: esp8266-httpd/"HTTPDVER"\r\n%s", 
 			(conn->priv->flags&HFL_HTTP11)?1:0, 
 			code, 
+			httpdStatusText(code),
 			connStr);
+	if (conn->priv->contentLen>=0 && lenHeader) l+=sprintf(buff+l, "Content-Length: %d\r\n", conn->priv->contentLen);
 	httpdSend(conn, buff, l);
 }
 
+//Start the response headers.
+void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
+	httpdSendStatus(conn, code, 1);
+}
+
+//Start the response headers and send a block of ready-made header lines (each ending in \r\n) in
+//one go, e.g. one that was built into the espfs image. The block includes the Content-Length header
+//if there is one; the cgi still needs to call httpdSetContentLength beforehand for the framing.
+void ICACHE_FLASH_ATTR httpdStartResponseHeaders(HttpdConnData *conn, int code, const char *block, int len) {
+	httpdSendStatus(conn, code, 0);
+	httpdSend(conn, block, len);
+}
+
 //Send a http header.
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
 	httpdSend(conn, field, -1);
@@ -315,6 +541,7 @@ int ICACHE_FLASH_ATTR cgiRedirectToHostname(HttpdConnData *connData) {
 	if (strcmp(connData->hostName, (char*)connData->cgiArg)==0) return HTTPD_CGI_NOTFOUND;
 	//Not the same. Redirect to real hostname.
 	buff=malloc(strlen((char*)connData->cgiArg)+sizeof(hostFmt));
+	httpdCount(&stats.heapAllocs);
 	if (buff==NULL) {
 		//Bail out
 		return HTTPD_CGI_DONE;
@@ -331,7 +558,7 @@ int ICACHE_FLASH_ATTR cgiRedirectToHostname(HttpdConnData *connData) {
 //the SoftAP interface. This should preclude clients connected to the STA interface
 //to be redirected to nowhere.
 int ICACHE_FLASH_ATTR cgiRedirectApClientToHostname(HttpdConnData *connData) {
-#ifndef FREERTOS
+#if !defined(FREERTOS) && !defined(HTTPD_POSIX)
 	uint32 *remadr;
 	struct ip_info apip;
 	int x=wifi_get_opmode();
@@ -353,35 +580,153 @@ int ICACHE_FLASH_ATTR cgiRedirectApClientToHostname(HttpdConnData *connData) {
 //Add data to the send buffer. len is the length of the data. If len is -1
 //the data is seen as a C-string.
 //Returns 1 for success, 0 for out-of-memory.
+//Called when len bytes of response data are dropped because there's no room for them. The client
+//can't make sense of the stream anymore: send what's queued, then close the connection so it sees a
+//truncated response instead of a corrupt one.
+static void ICACHE_FLASH_ATTR httpdSendDropped(HttpdConnData *conn, int len) {
+	httpd_printf("Pool slot %d: no room to send %d bytes; closing after what's queued is sent.\n", conn->slot, len);
+	httpdCount(&stats.backlogDrops);
+	conn->priv->flags&=~(HFL_CONTENTLEN|HFL_CHUNKED);
+	conn->priv->flags|=HFL_SENDDROPPED|HFL_DISCONAFTERSENT;
+}
+
+//httpdSend found no room in the send buffer. Cgis size what they send to the buffer, but data held
+//back from an earlier flush can leave less room than they expect; that counts as a drop.
+static int ICACHE_FLASH_ATTR httpdSendNoRoom(HttpdConnData *conn, int len) {
+	if (conn->priv->flags&HFL_SENDHELD) httpdSendDropped(conn, len);
+	return 0;
+}
+
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
 	if (conn->conn==NULL) return 0;
 	if (len<0) len=strlen(data);
 	if (len==0) return 0;
 	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY && conn->priv->chunkHdr==NULL) {
-		if (conn->priv->sendBuffLen+len+6>HTTPD_MAX_SENDBUFF_LEN) return 0;
+		if (conn->priv->sendBuffLen+len+6>HTTPD_MAX_SENDBUFF_LEN) return httpdSendNoRoom(conn, len);
 		//Establish start of chunk
 		conn->priv->chunkHdr=&conn->priv->sendBuff[conn->priv->sendBuffLen];
 		strcpy(conn->priv->chunkHdr, "0000\r\n");
 		conn->priv->sendBuffLen+=6;
 	}
-	if (conn->priv->sendBuffLen+len>HTTPD_MAX_SENDBUFF_LEN) return 0;
+	if (conn->priv->sendBuffLen+len>HTTPD_MAX_SENDBUFF_LEN) return httpdSendNoRoom(conn, len);
 	memcpy(conn->priv->sendBuff+conn->priv->sendBuffLen, data, len);
 	conn->priv->sendBuffLen+=len;
+	if (conn->priv->flags&HFL_SENDINGBODY) conn->priv->bodySent+=len;
 	return 1;
 }
 
+//Get the free part of the send buffer, so data can be read straight into it instead of into a buffer
+//httpdSend then copies from. Puts how many bytes fit there in *len. Write at most that many, then
+//call httpdSendCommit with the amount written. Returns NULL if there's no room right now; the cgi
+//gets called again once the buffer has been sent.
+char ICACHE_FLASH_ATTR *httpdSendReserve(HttpdConnData *conn, int *len) {
+	char *p=conn->priv->sendBuff+conn->priv->sendBuffLen;
+	*len=HTTPD_MAX_SENDBUFF_LEN-conn->priv->sendBuffLen;
+	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY) {
+		//Leave room for the chunk header httpdSendCommit puts in front, and for the chunk trailer and
+		//terminator the flush adds.
+		if (conn->priv->chunkHdr==NULL) {
+			p+=6;
+			*len-=6;
+		}
+		*len-=8;
+	}
+	if (conn->conn==NULL || *len<=0) {
+		*len=0;
+		return NULL;
+	}
+	return p;
+}
+
+//Send the len bytes that were written to the pointer httpdSendReserve returned.
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len) {
+	if (conn->conn==NULL || len<=0) return;
+	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY && conn->priv->chunkHdr==NULL) {
+		//The data is already behind where the chunk header goes; no terminating zero here.
+		conn->priv->chunkHdr=&conn->priv->sendBuff[conn->priv->sendBuffLen];
+		memcpy(conn->priv->chunkHdr, "0000\r\n", 6);
+		conn->priv->sendBuffLen+=6;
+	}
+	conn->priv->sendBuffLen+=len;
+	if (conn->priv->flags&HFL_SENDINGBODY) conn->priv->bodySent+=len;
+}
+
+//Send data that stays put, like a file in a memory-mapped espfs image, without copying it into the
+//send buffer: whatever is in the send buffer goes out first, then data is handed to the platform
+//directly. Returns how many bytes of data the platform took, which can be anything down to 0 if it's
+//busy; offer the rest again on the next cgi call. Returns -1 for chunked responses, which need
+//their framing added; use httpdSend for those.
+int ICACHE_FLASH_ATTR httpdSendDirect(HttpdConnData *conn, const char *data, int len) {
+	int r;
+	if (conn->conn==NULL) return 0;
+	if (conn->priv->flags&HFL_CHUNKED) return -1;
+	if (len<=0) return 0;
+	httpdFlushSendBuffer(conn);
+	if (conn->priv->flags&HFL_SENDDROPPED) return 0;
+	//Data has to go out after what's queued already; httpdContinue calls the cgi again when that's gone.
+	if (conn->priv->sendBacklogSize!=0 || (conn->priv->flags&HFL_SENDHELD)) return 0;
+	r=httpdPlatSendData(conn->conn, (char*)data, len);
+	if (r<0) r=0;
+	if (conn->priv->flags&HFL_SENDINGBODY) conn->priv->bodySent+=r;
+	return r;
+}
+
 static char ICACHE_FLASH_ATTR httpdHexNibble(int val) {
 	val&=0xf;
 	if (val<10) return '0'+val;
 	return 'A'+(val-10);
 }
 
+//Append len bytes of data to the send backlog ring buffer, which needs to be there. Returns 0 if
+//it doesn't fit.
+static int ICACHE_FLASH_ATTR httpdBacklogPut(HttpdPriv *priv, const char *data, int len) {
+	int wpos, n;
+	if (priv->sendBacklogSize+len>HTTPD_MAX_BACKLOG_SIZE) return 0;
+	wpos=(priv->sendBacklogPos+priv->sendBacklogSize)%HTTPD_MAX_BACKLOG_SIZE;
+	//Copy up to the end of the ring, then wrap around for the rest.
+	n=HTTPD_MAX_BACKLOG_SIZE-wpos;
+	if (n>len) n=len;
+	memcpy(&priv->sendBacklog[wpos], data, n);
+	memcpy(priv->sendBacklog, data+n, len-n);
+	priv->sendBacklogSize+=len;
+	return 1;
+}
+
+//Hand as much of the send backlog to the platform as it accepts. The backlog can wrap around
+//the end of the ring, so this is done in up to two contiguous spans.
+static void ICACHE_FLASH_ATTR httpdBacklogDrain(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int n, r;
+	while (priv->sendBacklogSize>0) {
+		n=HTTPD_MAX_BACKLOG_SIZE-priv->sendBacklogPos;
+		if (n>priv->sendBacklogSize) n=priv->sendBacklogSize;
+		r=httpdPlatSendData(conn->conn, &priv->sendBacklog[priv->sendBacklogPos], n);
+		if (r<=0) break;
+		priv->sendBacklogPos=(priv->sendBacklogPos+r)%HTTPD_MAX_BACKLOG_SIZE;
+		priv->sendBacklogSize-=r;
+		//Platform is full; we'll be called again when there's room.
+		if (r<n) break;
+	}
+	if (priv->sendBacklogSize==0) {
+		//All sent; let other connections use the buffer.
+		priv->sendBacklogPos=0;
+		httpdBufPut(&backlogPool, priv->sendBacklog);
+		priv->sendBacklog=NULL;
+	}
+}
+
 //Function to send any data in conn->priv->sendBuff. Do not use in CGIs unless you know what you
 //are doing! Also, if you do set conn->cgi to NULL to indicate the connection is closed, do it BEFORE
 //calling this.
 void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
 	int r, len;
 	if (conn->conn==NULL) return;
+	if (conn->priv->flags&HFL_SENDDROPPED) {
+		//Whatever comes after the dropped bytes would only corrupt the stream further.
+		conn->priv->chunkHdr=NULL;
+		conn->priv->sendBuffLen=0;
+		return;
+	}
 	if (conn->priv->chunkHdr!=NULL) {
 		//We're sending chunked data, and the chunk needs fixing up.
 		//Finish chunk with cr/lf
@@ -400,32 +745,30 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
 		//Connection finished sending whatever needs to be sent. Add NULL chunk to indicate this.
 		strcpy(&conn->priv->sendBuff[conn->priv->sendBuffLen], "0\r\n\r\n");
 		conn->priv->sendBuffLen+=5;
+		//That was the last of the body; later flushes mustn't add another one.
+		conn->priv->flags&=~HFL_SENDINGBODY;
 	}
 	if (conn->priv->sendBuffLen!=0) {
-		r=httpdPlatSendData(conn->conn, conn->priv->sendBuff, conn->priv->sendBuffLen);
-		if (!r) {
-			//Can't send this for some reason. Dump packet in backlog, we can send it later.
-			if (conn->priv->sendBacklogSize+conn->priv->sendBuffLen>HTTPD_MAX_BACKLOG_SIZE) {
-				httpd_printf("Httpd: Backlog: Exceeded max backlog size, dropped %d bytes instead of sending them.\n", conn->priv->sendBuffLen);
-				conn->priv->sendBuffLen=0;
-				return;
-			}
-			HttpSendBacklogItem *i=malloc(sizeof(HttpSendBacklogItem)+conn->priv->sendBuffLen);
-			if (i==NULL) {
-				httpd_printf("Httpd: Backlog: malloc failed, out of memory!\n");
-				return;
-			}
-			memcpy(i->data, conn->priv->sendBuff, conn->priv->sendBuffLen);
-			i->len=conn->priv->sendBuffLen;
-			i->next=NULL;
+		//If there's a backlog, this data needs to go after it. Otherwise, try to send it directly.
+		r=0;
+		if (conn->priv->sendBacklogSize==0) {
+			r=httpdPlatSendData(conn->conn, conn->priv->sendBuff, conn->priv->sendBuffLen);
+			if (r<0) r=0;
+		}
+		conn->priv->flags&=~HFL_SENDHELD;
+		if (r<conn->priv->sendBuffLen) {
+			//Can't send (all of) this right now. Dump the rest in the backlog, we can send it later.
+			len=conn->priv->sendBuffLen-r;
+			if (conn->priv->sendBacklog==NULL) conn->priv->sendBacklog=httpdBufGet(&backlogPool);
 			if (conn->priv->sendBacklog==NULL) {
-				conn->priv->sendBacklog=i;
-			} else {
-				HttpSendBacklogItem *e=conn->priv->sendBacklog;
-				while (e->next!=NULL) e=e->next;
-				e->next=i;
+				//All backlog buffers are taken. Hold the rest in the send buffer instead; httpdContinue
+				//sends it before the cgi gets to add anything.
+				memmove(conn->priv->sendBuff, conn->priv->sendBuff+r, len);
+				conn->priv->sendBuffLen=len;
+				conn->priv->flags|=HFL_SENDHELD;
+				return;
 			}
-			conn->priv->sendBacklogSize+=conn->priv->sendBuffLen;
+			if (!httpdBacklogPut(conn->priv, conn->priv->sendBuff+r, len)) httpdSendDropped(conn, len);
 		}
 		conn->priv->sendBuffLen=0;
 	}
@@ -433,15 +776,30 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
 
 void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdConnData *conn) {
 	conn->cgi=NULL; //no need to call this anymore
-	if (conn->priv->flags&HFL_CHUNKED) {
+	//The cgi won't look at POST data anymore.
+	httpdBufPut(&postPool, conn->post->buff);
+	conn->post->buff=NULL;
+	if ((conn->priv->flags&HFL_CONTENTLEN) && conn->priv->bodySent!=conn->priv->contentLen) {
+		//The client would wait for more body, or take the excess for the next response.
+		httpd_printf("Pool slot %d: cgi sent %d bytes instead of the %d it promised.\n", conn->slot, conn->priv->bodySent, conn->priv->contentLen);
+		conn->priv->flags&=~HFL_CONTENTLEN;
+	}
+	//Flush before deciding whether the connection can be re-used: an overflowing backlog marks it
+	//for closing.
+	httpdFlushSendBuffer(conn);
+	if ((conn->priv->flags&(HFL_CHUNKED|HFL_CONTENTLEN)) && !(conn->priv->flags&HFL_PIPEFULL)) {
 		httpd_printf("Pool slot %d is done. Cleaning up for next req\n", conn->slot);
-		httpdFlushSendBuffer(conn);
 		//Note: Do not clean up sendBacklog, it may still contain data at this point.
 		conn->priv->headPos=0;
+		conn->priv->headLineStart=0;
+		httpdResetHeaderIndex(conn->priv);
 		conn->post->len=-1;
-		conn->priv->flags=0;
-		if (conn->post->buff) free(conn->post->buff);
-		conn->post->buff=NULL;
+		//Data held back in the send buffer still has to go out first.
+		conn->priv->flags&=HFL_SENDHELD;
+		conn->priv->contentLen=-1;
+		conn->priv->bodySent=0;
+		conn->url=NULL;
+		conn->getArgs=NULL;
 		conn->post->buffLen=0;
 		conn->post->received=0;
 		conn->hostName=NULL;
@@ -455,62 +813,155 @@ void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdConnData *conn) {
 //sent.
 void ICACHE_FLASH_ATTR httpdSentCb(ConnTypePtr rconn, char *remIp, int remPort) {
 	HttpdConnData *conn=httpdFindConnData(rconn, remIp, remPort);
+	if (conn==NULL) return;
 	httpdContinue(conn);
+	httpdPlatUnlockSlot(conn->slot);
 }
 
+static void httpdParsePipeline(HttpdConnData *conn);
+
 //Can be called after a CGI function has returned HTTPD_CGI_MORE to
 //resume handling an open connection asynchronously
 void ICACHE_FLASH_ATTR httpdContinue(HttpdConnData * conn) {
-	int r;
-	httpdPlatLock();
-
-	char *sendBuff;
-
+	int r, idle;
 	if (conn==NULL) return;
+	httpdLockSlot(conn->slot);
 
-	if (conn->priv->sendBacklog!=NULL) {
-		//We have some backlog to send first.
-		HttpSendBacklogItem *next=conn->priv->sendBacklog->next;
-		httpdPlatSendData(conn->conn, conn->priv->sendBacklog->data, conn->priv->sendBacklog->len);
-		conn->priv->sendBacklogSize-=conn->priv->sendBacklog->len;
-		free(conn->priv->sendBacklog);
-		conn->priv->sendBacklog=next;
-		httpdPlatUnlock();
+	if (conn->priv->sendBacklogSize!=0 || (conn->priv->flags&HFL_SENDHELD)) {
+		//We have some backlog to send first. Send what we can; we'll get called again when that
+		//has been sent.
+		httpdBacklogDrain(conn);
+		httpdFlushSendBuffer(conn);
+		httpdPlatUnlockSlot(conn->slot);
 		return;
 	}
 
 	if (conn->priv->flags&HFL_DISCONAFTERSENT) { //Marked for destruction?
 		httpd_printf("Pool slot %d is done. Closing.\n", conn->slot);
 		httpdPlatDisconnect(conn->conn);
-		httpdPlatUnlock();
+		httpdPlatUnlockSlot(conn->slot);
 		return; //No need to call httpdFlushSendBuffer.
 	}
 
-	//If we don't have a CGI function, there's nothing to do but wait for something from the client.
-	if (conn->cgi==NULL) {
-		httpdPlatUnlock();
-		return;
+	if (conn->cgi!=NULL) {
+		r=conn->cgi(conn); //Execute cgi fn.
+		if (r==HTTPD_CGI_DONE) {
+			//Everything sent before has gone out, so if the last call didn't add anything (and there's
+			//no final chunk to add), no sent callback will come to close the connection on.
+			idle=(conn->priv->sendBuffLen==0 && !(conn->priv->flags&HFL_CHUNKED));
+			httpdCgiIsDone(conn);
+			if (idle && (conn->priv->flags&HFL_DISCONAFTERSENT)) {
+				httpd_printf("Pool slot %d is done. Closing.\n", conn->slot);
+				httpdPlatDisconnect(conn->conn);
+				httpdPlatUnlockSlot(conn->slot);
+				return;
+			}
+		}
+		if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
+			httpd_printf("ERROR! CGI fn returns code %d after sending data! Bad CGI!\n", r);
+			httpdCgiIsDone(conn);
+		}
 	}
+	//Data the client sent while we were busy can be handled now. Without a cgi, that's all there is
+	//to do until the client sends more.
+	httpdParsePipeline(conn);
+	httpdFlushSendBuffer(conn);
+	httpdPlatUnlockSlot(conn->slot);
+}
 
-	sendBuff=malloc(HTTPD_MAX_SENDBUFF_LEN);
-	if (sendBuff==NULL) {
-		httpd_printf("Malloc of sendBuff failed!\n");
-		httpdPlatUnlock();
+static uint32_t ICACHE_FLASH_ATTR httpdRouteHash(const char *s, int len) {
+	uint32_t h=FNV_BASIS;
+	while (len--) h=(h^(uint8_t)*s++)*FNV_PRIME;
+	return h;
+}
+
+//Compile builtInUrls into the route hash table. If there's no memory for it, routes stays NULL
+//and httpdRouteFind falls back to going through the table.
+static void ICACHE_FLASH_ATTR httpdRouterInit() {
+	int n, i, j, nb, len;
+	int16_t *e;
+	char *mem;
+	for (n=0; builtInUrls[n].url!=NULL; n++) ;
+	nb=8;
+	while (nb<n*2) nb<<=1;
+	mem=malloc(n*sizeof(HttpdRoute)+n*sizeof(uint16_t)+nb*sizeof(int16_t));
+	if (mem==NULL) {
+		httpd_printf("Httpd: No mem for url router, using linear search.\n");
 		return;
 	}
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
-	r=conn->cgi(conn); //Execute cgi fn.
-	if (r==HTTPD_CGI_DONE) {
-		httpdCgiIsDone(conn);
+	routes=(HttpdRoute*)mem;
+	routeWildLens=(uint16_t*)(mem+n*sizeof(HttpdRoute));
+	routeBuckets=(int16_t*)(mem+n*sizeof(HttpdRoute)+n*sizeof(uint16_t));
+	routeBucketMask=nb-1;
+	routeWildLenCt=0;
+	for (i=0; i<nb; i++) routeBuckets[i]=-1;
+	for (i=0; i<n; i++) {
+		len=strlen(builtInUrls[i].url);
+		routes[i].wild=(len>0 && builtInUrls[i].url[len-1]=='*');
+		if (routes[i].wild) len--;
+		routes[i].len=len;
+		routes[i].hash=httpdRouteHash(builtInUrls[i].url, len);
+		routes[i].next=-1;
+		//Append to the end of the bucket chain to keep it in table order
+		e=&routeBuckets[routes[i].hash&routeBucketMask];
+		while (*e!=-1) e=&routes[*e].next;
+		*e=i;
+		if (routes[i].wild) {
+			//Insertion-sort the prefix length into the list, skipping duplicates
+			for (j=0; j<routeWildLenCt && routeWildLens[j]<len; j++) ;
+			if (j==routeWildLenCt || routeWildLens[j]!=len) {
+				memmove(&routeWildLens[j+1], &routeWildLens[j], (routeWildLenCt-j)*sizeof(uint16_t));
+				routeWildLens[j]=len;
+				routeWildLenCt++;
+			}
+		}
+	}
+}
+
+//Look in the bucket for hash for the first entry after 'after' that has a pattern of length len
+//and the given wildcard-ness that matches url. Returns that or best, whichever comes first in
+//the table.
+static int ICACHE_FLASH_ATTR httpdRouteProbe(const char *url, uint32_t hash, int len, int wild, int after, int best) {
+	int i;
+	for (i=routeBuckets[hash&routeBucketMask]; i!=-1; i=routes[i].next) {
+		if (best!=-1 && i>=best) break; //chain is in table order; nothing better after this
+		if (i<=after) continue;
+		if (routes[i].hash==hash && routes[i].len==len && routes[i].wild==wild &&
+				strncmp(builtInUrls[i].url, url, len)==0) return i;
 	}
-	if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
-		httpd_printf("ERROR! CGI fn returns code %d after sending data! Bad CGI!\n", r);
-		httpdCgiIsDone(conn);
+	return best;
+}
+
+//Find the first entry in builtInUrls after index 'after' that matches url. Returns its index, or
+//-1 if there's none.
+static int ICACHE_FLASH_ATTR httpdRouteFind(const char *url, int after) {
+	int i, p, w, best=-1;
+	uint32_t h=FNV_BASIS;
+	if (routes==NULL) {
+		//No compiled table. Do it the slow way.
+		for (i=after+1; builtInUrls[i].url!=NULL; i++) {
+			//See if there's a literal match
+			if (strcmp(builtInUrls[i].url, url)==0) return i;
+			//See if there's a wildcard match
+			p=strlen(builtInUrls[i].url)-1;
+			if (builtInUrls[i].url[p]=='*' && strncmp(builtInUrls[i].url, url, p)==0) return i;
+		}
+		return -1;
 	}
-	httpdFlushSendBuffer(conn);
-	free(sendBuff);
-	httpdPlatUnlock();
+	//Hash the url incrementally. Every time the part hashed so far is as long as a wildcard
+	//prefix, see if there's a wildcard pattern for it.
+	p=0; w=0;
+	while (1) {
+		if (w<routeWildLenCt && routeWildLens[w]==p) {
+			best=httpdRouteProbe(url, h, p, 1, after, best);
+			w++;
+		}
+		if (url[p]==0) break;
+		h=(h^(uint8_t)url[p])*FNV_PRIME;
+		p++;
+	}
+	//Literal match on the whole url
+	return httpdRouteProbe(url, h, p, 0, after, best);
 }
 
 //This is called when the headers have been received and the connection is ready to send
@@ -519,31 +970,22 @@ void ICACHE_FLASH_ATTR httpdContinue(HttpdConnData * conn) {
 //find the next cgi function, wait till the cgi data is sent or close up the connection.
 static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	int r;
-	int i=0;
+	int i=-1;
 	if (conn->url==NULL) {
 		httpd_printf("WtF? url = NULL\n");
 		return; //Shouldn't happen
 	}
+	httpdCount(&stats.requests);
 	//See if we can find a CGI that's happy to handle the request.
 	while (1) {
-		//Look up URL in the built-in URL table.
-		while (builtInUrls[i].url!=NULL) {
-			int match=0;
-			//See if there's a literal match
-			if (strcmp(builtInUrls[i].url, conn->url)==0) match=1;
-			//See if there's a wildcard match
-			if (builtInUrls[i].url[strlen(builtInUrls[i].url)-1]=='*' &&
-					strncmp(builtInUrls[i].url, conn->url, strlen(builtInUrls[i].url)-1)==0) match=1;
-			if (match) {
-				httpd_printf("Is url index %d\n", i);
-				conn->cgiData=NULL;
-				conn->cgi=builtInUrls[i].cgiCb;
-				conn->cgiArg=builtInUrls[i].cgiArg;
-				break;
-			}
-			i++;
-		}
-		if (builtInUrls[i].url==NULL) {
+		//Look up URL in the built-in URL table, starting after the last entry we tried.
+		i=httpdRouteFind(conn->url, i);
+		if (i!=-1) {
+			httpd_printf("Is url index %d\n", i);
+			conn->cgiData=NULL;
+			conn->cgi=builtInUrls[i].cgiCb;
+			conn->cgiArg=builtInUrls[i].cgiArg;
+		} else {
 			//Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
 			//generate a built-in 404 to handle this.
 			httpd_printf("%s not found. 404!\n", conn->url);
@@ -568,8 +1010,7 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 			return;
 		} else if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
 			//URL doesn't want to handle the request: either the data isn't found or there's no
-			//need to generate a login screen.
-			i++; //look at next url the next iteration of the loop.
+			//need to generate a login screen. The next iteration will look at the entries after i.
 		}
 	}
 }
@@ -637,12 +1078,9 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 		} else {
 			conn->post->buffSize = conn->post->len;
 		}
-		httpd_printf("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
-		conn->post->buff=(char*)malloc(conn->post->buffSize + 1);
-		if (conn->post->buff==NULL) {
-			printf("...failed!\n");
-			return;
-		}
+		//Buffers in postPool have room for HTTPD_MAX_POST_LEN bytes plus a terminating zero. If none is
+		//free, httpdParseData answers with a 503 once the head is in.
+		if (conn->post->len>0 && conn->post->buff==NULL) conn->post->buff=httpdBufGet(&postPool);
 		conn->post->buffLen=0;
 	} else if (strncmp(h, "Content-Type: ", 14)==0) {
 		if (strstr(h, "multipart/form-data")) {
@@ -658,89 +1096,121 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 	}
 }
 
-//Make a connection 'live' so we can do all the things a cgi can do to it.
-//ToDo: Also make httpdRecvCb/httpdContinue use these?
-//ToDo: Fail if malloc fails?
-void ICACHE_FLASH_ATTR httpdConnSendStart(HttpdConnData *conn) {
-	httpdPlatLock();
-	char *sendBuff=malloc(HTTPD_MAX_SENDBUFF_LEN);
-	if (sendBuff==NULL) {
-		printf("Malloc sendBuff failed!\n");
-		return;
-	}
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
+//Make a connection 'live' so we can do all the things a cgi can do to it, from a task other than
+//the httpd one. gen is conn->gen from when the connection was known to be open: the connection
+//may have been closed since, and its slot re-used for another one. Returns 1 if it's still the same
+//connection; call httpdConnSendFinish when done. Returns 0, without holding any lock, if it isn't.
+//The send buffer belongs to the slot, so this is safe to call from within a callback for
+//the same connection as well: anything already in the buffer simply goes out first.
+int ICACHE_FLASH_ATTR httpdConnSendStart(HttpdConnData *conn, unsigned int gen) {
+	//Don't use conn->slot before holding the lock; the slot may be getting set up for a new connection.
+	int slot=(HttpdSlot*)conn-slots;
+	httpdLockSlot(slot);
+	if (connData[slot]==conn && conn->gen==gen && conn->conn!=NULL) return 1;
+	httpdPlatUnlockSlot(slot);
+	return 0;
 }
 
 //Finish the live-ness of a connection. Always call this after httpdConnStart
 void ICACHE_FLASH_ATTR httpdConnSendFinish(HttpdConnData *conn) {
 	if (conn->conn) httpdFlushSendBuffer(conn);
-	free(conn->priv->sendBuff);
-	httpdPlatUnlock();
+	httpdPlatUnlockSlot(conn->slot);
 }
 
-//Callback called when there's data available on a socket.
-void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort, char *data, unsigned short len) {
-	int x, r;
-	char *p, *e;
-	httpdPlatLock();
-	char *sendBuff=malloc(HTTPD_MAX_SENDBUFF_LEN);
-	if (sendBuff==NULL) {
-		printf("Malloc sendBuff failed!\n");
-		httpdPlatUnlock();
-		return;
+//Handle one byte of the request head. Lines are zero-terminated and parsed as soon as their
+//line end comes in, so nothing ever needs to be rescanned. Returns 1 when the empty line that ends
+//the head is received, -1 if the head doesn't fit in HTTPD_MAX_HEAD_LEN and 0 otherwise.
+static int ICACHE_FLASH_ATTR httpdHeadByte(HttpdConnData *conn, char c) {
+	HttpdPriv *priv=conn->priv;
+	if (c=='\n') {
+		//Drop the \r, if any; clients sending a bare \n are accepted as well.
+		if (priv->headPos>priv->headLineStart && priv->head[priv->headPos-1]=='\r') priv->headPos--;
+		if (priv->headPos==priv->headLineStart) return 1;
+		//Zero-terminate the line. Anything but the request line goes into the header index.
+		priv->head[priv->headPos++]=0;
+		if (priv->headLineStart!=0) httpdIndexHeader(priv, priv->headLineStart);
+		httpdParseHeader(&priv->head[priv->headLineStart], conn);
+		priv->headLineStart=priv->headPos;
+		return 0;
 	}
+	//Always keep room for the terminator of this line.
+	if (priv->headPos>=HTTPD_MAX_HEAD_LEN-1) return -1;
+	priv->head[priv->headPos++]=c;
+	return 0;
+}
 
-	HttpdConnData *conn=httpdFindConnData(rconn, remIp, remPort);
-	if (conn==NULL) {
-		httpdPlatUnlock();
-		return;
-	}
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
+//Used when the request head doesn't fit in HTTPD_MAX_HEAD_LEN.
+static void ICACHE_FLASH_ATTR httpdHeadTooLong(HttpdConnData *conn) {
+	httpd_printf("Pool slot %d: request head too long.\n", conn->slot);
+	conn->cgi=NULL;
+	conn->priv->flags&=~HFL_CHUNKED;
+	httpdStartResponse(conn, 431);
+	httpdEndHeaders(conn);
+	httpdSend(conn, "431 Request header fields too large.", -1);
+	conn->priv->flags|=HFL_DISCONAFTERSENT;
+}
+
+//Used when a request has a body, but all POST buffers are in use.
+static void ICACHE_FLASH_ATTR httpdNoPostBuffer(HttpdConnData *conn) {
+	httpd_printf("Pool slot %d: no POST buffer free.\n", conn->slot);
+	conn->cgi=NULL;
+	conn->priv->flags&=~HFL_CHUNKED;
+	httpdStartResponse(conn, 503);
+	httpdHeader(conn, "Retry-After", "1");
+	httpdEndHeaders(conn);
+	httpdSend(conn, "503 Server busy.", -1);
+	conn->priv->flags|=HFL_DISCONAFTERSENT;
+}
 
-	//This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
-	//<0 (-1): Post len unknown because we're still receiving headers
-	//==0: No post data
-	//>0: Need to receive post data
-	//ToDo: See if we can use something more elegant for this.
+//Feed received data to the request parser. Returns the amount of bytes used. This stops early
+//when a request is complete but its cgi isn't done yet; the rest of the data belongs to the next
+//(pipelined) request, which has to wait its turn.
+static int ICACHE_FLASH_ATTR httpdParseData(HttpdConnData *conn, char *data, int len) {
+	int x, r, n;
+
+	//Where in the http communications we are is tracked by the HFL_HEADDONE flag and conn->post->len:
+	//No HFL_HEADDONE: we're still receiving headers
+	//HFL_HEADDONE, post->len==0: No post data
+	//HFL_HEADDONE, post->len>0: Need to receive post data
 
 	for (x=0; x<len; x++) {
-		if (conn->post->len<0) {
+		if (conn->priv->flags&HFL_DISCONAFTERSENT) {
+			//We're closing this connection. Whatever the client still has to say doesn't matter.
+			return len;
+		}
+		if (!(conn->priv->flags&HFL_HEADDONE) && conn->priv->headPos==0 && (conn->priv->flags&HFL_SENDHELD)) {
+			//The previous response is still held back in the send buffer, which leaves no room for the
+			//response to this one. It gets parsed from the pipeline buffer once that's gone.
+			return x;
+		}
+		if (!(conn->priv->flags&HFL_HEADDONE)) {
 			//This byte is a header byte.
-			if (data[x]=='\n') {
-				//Compatibility with clients that send \n only: fake a \r in front of this.
-				if (conn->priv->headPos!=0 && conn->priv->head[conn->priv->headPos-1]!='\r') {
-					conn->priv->head[conn->priv->headPos++]='\r';
-				}
-			}
-			//ToDo: return http error code 431 (request header too long) if this happens
-			if (conn->priv->headPos!=HTTPD_MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++]=data[x];
-			conn->priv->head[conn->priv->headPos]=0;
-			//Scan for /r/n/r/n. Receiving this indicate the headers end.
-			if (data[x]=='\n' && (char *)strstr(conn->priv->head, "\r\n\r\n")!=NULL) {
+			r=httpdHeadByte(conn, data[x]);
+			if (r<0) {
+				httpdHeadTooLong(conn);
+				return len;
+			} else if (r==1) {
 				//Indicate we're done with the headers.
-				conn->post->len=0;
-				//Reset url data
-				conn->url=NULL;
-				//Iterate over all received headers and parse them.
-				p=conn->priv->head;
-				while(p<(&conn->priv->head[conn->priv->headPos-4])) {
-					e=(char *)strstr(p, "\r\n"); //Find end of header line
-					if (e==NULL) break;			//Shouldn't happen.
-					e[0]=0;						//Zero-terminate header
-					httpdParseHeader(p, conn);	//and parse it.
-					p=e+2;						//Skip /r/n (now /0/n)
-				}
+				conn->priv->flags|=HFL_HEADDONE;
+				if (conn->post->len<0) conn->post->len=0;
 				//If we don't need to receive post data, we can send the response now.
 				if (conn->post->len==0) {
 					httpdProcessRequest(conn);
+				} else if (conn->post->buff==NULL) {
+					httpdNoPostBuffer(conn);
+					return len;
 				}
 			}
-		} else if (conn->post->len!=0) {
-			//This byte is a POST byte.
-			conn->post->buff[conn->post->buffLen++]=data[x];
-			conn->post->received++;
+		} else if (conn->post->received<conn->post->len) {
+			//This is POST data. Move as much of it as fits in the post buffer in one go; the cgi
+			//only gets called when the buffer is full or the body is complete.
+			n=len-x;
+			if (n>conn->post->buffSize-conn->post->buffLen) n=conn->post->buffSize-conn->post->buffLen;
+			if (n>conn->post->len-conn->post->received) n=conn->post->len-conn->post->received;
+			memcpy(conn->post->buff+conn->post->buffLen, data+x, n);
+			conn->post->buffLen+=n;
+			conn->post->received+=n;
+			x+=n-1;
 			conn->hostName=NULL;
 			if (conn->post->buffLen >= conn->post->buffSize || conn->post->received == conn->post->len) {
 				//Received a chunk of post data
@@ -758,96 +1228,167 @@ void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort,
 				}
 				conn->post->buffLen = 0;
 			}
-		} else {
-			//Let cgi handle data if it registered a recvHdl callback. If not, ignore.
-			if (conn->recvHdl) {
-				r=conn->recvHdl(conn, data+x, len-x);
-				if (r==HTTPD_CGI_DONE) {
-					httpd_printf("Recvhdl returned DONE\n");
-					httpdCgiIsDone(conn);
-					//We assume the recvhdlr has sent something; we'll kill the sock in the sent callback.
-				}
-				break; //ignore rest of data, recvhdl has parsed it.
-			} else {
-				httpd_printf("Eh? Got unexpected data from client. %s\n", data);
+		} else if (conn->recvHdl) {
+			//Let cgi handle data if it registered a recvHdl callback.
+			r=conn->recvHdl(conn, data+x, len-x);
+			if (r==HTTPD_CGI_DONE) {
+				httpd_printf("Recvhdl returned DONE\n");
+				httpdCgiIsDone(conn);
+				//We assume the recvhdlr has sent something; we'll kill the sock in the sent callback.
 			}
+			return len; //recvhdl has parsed the rest of the data.
+		} else {
+			//The request is complete but its cgi is still working on the response. This is the
+			//start of the next request.
+			return x;
 		}
 	}
+	return len;
+}
+
+//Parse as much of the queued pipelined requests as the state of the connection allows.
+static void ICACHE_FLASH_ATTR httpdParsePipeline(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int n;
+	if (priv->pipeLen==0) return;
+	n=httpdParseData(conn, priv->pipeBuf, priv->pipeLen);
+	memmove(priv->pipeBuf, priv->pipeBuf+n, priv->pipeLen-n);
+	priv->pipeLen-=n;
+	if (priv->pipeLen==0) {
+		httpdBufPut(&pipePool, priv->pipeBuf);
+		priv->pipeBuf=NULL;
+	}
+}
+
+//Queue data for a request that has to wait until the cgi of the one before it is done.
+static void ICACHE_FLASH_ATTR httpdQueuePipeline(HttpdConnData *conn, char *data, int len) {
+	HttpdPriv *priv=conn->priv;
+	if (len==0 || (priv->flags&HFL_PIPEFULL)) return;
+	if (priv->pipeBuf==NULL) priv->pipeBuf=httpdBufGet(&pipePool);
+	if (priv->pipeBuf==NULL || priv->pipeLen+len>HTTPD_MAX_PIPELINE_LEN) {
+		//Client is too far ahead of us. Finish the current response, then close the connection;
+		//the client will re-send the requests it didn't get an answer for.
+		httpd_printf("Pool slot %d: pipeline full, dropping %d bytes.\n", conn->slot, len);
+		priv->flags|=HFL_PIPEFULL;
+		httpdBufPut(&pipePool, priv->pipeBuf);
+		priv->pipeBuf=NULL;
+		priv->pipeLen=0;
+		//If the current response is done already, there's no httpdCgiIsDone left to close it.
+		if (conn->cgi==NULL) priv->flags|=HFL_DISCONAFTERSENT;
+		return;
+	}
+	memcpy(priv->pipeBuf+priv->pipeLen, data, len);
+	priv->pipeLen+=len;
+}
+
+//Callback called when there's data available on a socket.
+void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort, char *data, unsigned short len) {
+	int n;
+	HttpdConnData *conn=httpdFindConnData(rconn, remIp, remPort);
+	if (conn==NULL) return;
+
+	if (conn->priv->pipeLen!=0) {
+		//Earlier requests are still waiting for their turn; this data goes behind them.
+		httpdQueuePipeline(conn, data, len);
+	} else {
+		n=httpdParseData(conn, data, len);
+		httpdQueuePipeline(conn, data+n, len-n);
+	}
 	if (conn->conn) httpdFlushSendBuffer(conn);
-	free(sendBuff);
-	httpdPlatUnlock();
+	httpdPlatUnlockSlot(conn->slot);
 }
 
 //The platform layer should ALWAYS call this function, regardless if the connection is closed by the server
 //or by the client.
 void ICACHE_FLASH_ATTR httpdDisconCb(ConnTypePtr rconn, char *remIp, int remPort) {
-	httpdPlatLock();
 	HttpdConnData *hconn=httpdFindConnData(rconn, remIp, remPort);
-	if (hconn==NULL) {
-		httpdPlatUnlock();
-		return;
-	}
+	if (hconn==NULL) return;
 	httpd_printf("Pool slot %d: socket closed.\n", hconn->slot);
 	hconn->conn=NULL; //indicate cgi the connection is gone
 	if (hconn->cgi) hconn->cgi(hconn); //Execute cgi fn if needed
-	httpdRetireConn(hconn);
-	httpdPlatUnlock();
+	httpdRetireConn(hconn, rconn);
+	httpdPlatUnlockSlot(hconn->slot);
 }
 
 
 int ICACHE_FLASH_ATTR httpdConnectCb(ConnTypePtr conn, char *remIp, int remPort) {
 	int i;
+	unsigned int gen;
+	HttpdConnData *hconn;
 	httpdPlatLock();
 	//Find empty conndata in pool
 	for (i=0; i<HTTPD_MAX_CONNECTIONS; i++) if (connData[i]==NULL) break;
 	httpd_printf("Conn req from  %d.%d.%d.%d:%d, using pool slot %d\n", remIp[0]&0xff, remIp[1]&0xff, remIp[2]&0xff, remIp[3]&0xff, remPort, i);
-	if (i==HTTPD_MAX_CONNECTIONS) {
+	if (i==HTTPD_MAX_CONNECTIONS || slots==NULL) {
 		httpd_printf("Aiee, conn pool overflow!\n");
 		httpdPlatUnlock();
 		return 0;
 	}
-	connData[i]=malloc(sizeof(HttpdConnData));
-	if (connData[i]==NULL) {
-		printf("Out of memory allocating connData!\n");
-		httpdPlatUnlock();
-		return 0;
-	}
-	memset(connData[i], 0, sizeof(HttpdConnData));
-	connData[i]->priv=malloc(sizeof(HttpdPriv));
-	memset(connData[i]->priv, 0, sizeof(HttpdPriv));
-	connData[i]->conn=conn;
-	connData[i]->slot=i;
-	connData[i]->priv->headPos=0;
-	connData[i]->post=malloc(sizeof(HttpdPostData));
-	if (connData[i]->post==NULL) {
-		printf("Out of memory allocating connData post struct!\n");
-		httpdPlatUnlock();
-		return 0;
-	}
-	memset(connData[i]->post, 0, sizeof(HttpdPostData));
-	connData[i]->post->buff=NULL;
-	connData[i]->post->buffLen=0;
-	connData[i]->post->received=0;
-	connData[i]->post->len=-1;
-	connData[i]->hostName=NULL;
-	connData[i]->remote_port=remPort;
-	connData[i]->priv->sendBacklog=NULL;
-	connData[i]->priv->sendBacklogSize=0;
-	memcpy(connData[i]->remote_ip, remIp, 4);
-
+	//Claim the slot. It's set up under its own lock: other tasks may still have a pointer to the
+	//connection that was in it before, and be waiting for that lock in httpdConnSendStart.
+	connData[i]=&slots[i].conn;
 	httpdPlatUnlock();
+
+	httpdLockSlot(i);
+	//Re-initialize the slot. The head and send buffers don't need clearing, only their positions.
+	//httpdRetireConn gave the shared buffers of the previous connection back.
+	hconn=&slots[i].conn;
+	gen=hconn->gen;
+	memset(hconn, 0, sizeof(HttpdConnData));
+	hconn->gen=gen;
+	hconn->priv=&slots[i].priv;
+	hconn->priv->headPos=0;
+	hconn->priv->headLineStart=0;
+	httpdResetHeaderIndex(hconn->priv);
+	hconn->priv->sendBuffLen=0;
+	hconn->priv->chunkHdr=NULL;
+	hconn->priv->flags=0;
+	hconn->priv->contentLen=-1;
+	hconn->priv->bodySent=0;
+	hconn->priv->pipeBuf=NULL;
+	hconn->priv->pipeLen=0;
+	hconn->conn=conn;
+	hconn->slot=i;
+	hconn->post=&slots[i].post;
+	memset(hconn->post, 0, sizeof(HttpdPostData));
+	hconn->post->buff=NULL;
+	hconn->post->buffLen=0;
+	hconn->post->received=0;
+	hconn->post->len=-1;
+	hconn->hostName=NULL;
+	hconn->remote_port=remPort;
+	hconn->priv->sendBacklog=NULL;
+	hconn->priv->sendBacklogPos=0;
+	hconn->priv->sendBacklogSize=0;
+	memcpy(hconn->remote_ip, remIp, 4);
+	httpdPlatSetConnData(conn, remIp, remPort, hconn);
+
+	httpdPlatUnlockSlot(i);
 	return 1;
 }
 
-//Httpd initialization routine. Call this to kick off webserver functionality.
-void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
+//Httpd initialization routine. Call this to kick off webserver functionality. Returns 1 if the
+//webserver is running, 0 if there wasn't enough memory for the connection slots.
+int ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
 	int i;
 
 	for (i=0; i<HTTPD_MAX_CONNECTIONS; i++) {
 		connData[i]=NULL;
 	}
 	builtInUrls=fixedUrls;
+	httpdRouterInit();
+
+	//Allocate the memory for all connection slots in one go. The shared buffers are allocated
+	//when first needed.
+	slots=malloc(sizeof(HttpdSlot)*HTTPD_MAX_CONNECTIONS);
+	if (slots==NULL) {
+		printf("Httpd: Can't allocate %d bytes for connection slots!\n", (int)(sizeof(HttpdSlot)*HTTPD_MAX_CONNECTIONS));
+		return 0;
+	}
+	memset(slots, 0, sizeof(HttpdSlot)*HTTPD_MAX_CONNECTIONS);
+	memset(&stats, 0, sizeof(stats));
 
 	httpdPlatInit(port, HTTPD_MAX_CONNECTIONS);
-	httpd_printf("Httpd init\n");
+	httpd_printf("Httpd init, %d bytes for %d connection slots\n", (int)(sizeof(HttpdSlot)*HTTPD_MAX_CONNECTIONS), HTTPD_MAX_CONNECTIONS);
+	return 1;
 }
@@ -20,6 +20,115 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
+//Turn the content hash mkespfsimage stored for the file into a quoted ETag. Returns 0 if there's none.
+static int ICACHE_FLASH_ATTR espFsEtag(EspFsFile *file, char *etag) {
+	char hash[ESPFS_HASH_LEN];
+	int i;
+	if (!espFsHash(file, hash)) return 0;
+	etag[0]='"';
+	for (i=0; i<ESPFS_HASH_LEN; i++) sprintf(&etag[1+i*2], "%02x", (uint8_t)hash[i]);
+	etag[1+ESPFS_HASH_LEN*2]='"';
+	etag[2+ESPFS_HASH_LEN*2]=0;
+	return 1;
+}
+
+//Check if the If-None-Match header of the request lists the ETag (or is a *).
+static int ICACHE_FLASH_ATTR etagMatches(HttpdConnData *connData, const char *etag) {
+	const char *inm=httpdGetHeaderPtr(connData, "If-None-Match", NULL);
+	if (inm==NULL) return 0;
+	if (strcmp(inm, "*")==0) return 1;
+	return strstr(inm, etag)!=NULL;
+}
+
+
+//The file is compressed and all decoders are in use. Tell the client to come back in a bit instead of
+//pretending the file isn't there.
+static int ICACHE_FLASH_ATTR espFsBusy(HttpdConnData *connData) {
+	httpdSetContentLength(connData, 0);
+	httpdStartResponse(connData, 503);
+	httpdHeader(connData, "Retry-After", "1");
+	httpdEndHeaders(connData);
+	return HTTPD_CGI_DONE;
+}
+
+//Parse the digits at *p into *val, stopping at size: anything beyond the end of the file means the
+//same as the end itself, and the client controls how many digits there are. Returns 1 if there were
+//any digits.
+static int ICACHE_FLASH_ATTR parseRangeNum(const char **p, int size, int *val) {
+	int any=0, d;
+	*val=0;
+	while (**p>='0' && **p<='9') {
+		d=*(*p)++-'0';
+		//The first check keeps *val*10 from overflowing.
+		if (*val>(size-d)/10 || *val*10+d>size) *val=size; else *val=*val*10+d;
+		any=1;
+	}
+	return any;
+}
+
+//Parse the value of a Range header against a file of size bytes. Only a single "bytes=" range is
+//handled. Returns 1 with the first and last (inclusive) byte of the range if it can be satisfied,
+//0 if it can't, and -1 for anything else, which means the whole file should be sent.
+static int ICACHE_FLASH_ATTR parseRange(const char *range, int size, int *first, int *last) {
+	const char *p;
+	int hasFirst, hasLast;
+	if (strncmp(range, "bytes=", 6)!=0 || strchr(range, ',')!=NULL) return -1;
+	p=range+6;
+	while (*p==' ') p++;
+	hasFirst=parseRangeNum(&p, size, first);
+	if (*p++!='-') return -1;
+	hasLast=parseRangeNum(&p, size, last);
+	while (*p==' ') p++;
+	if (*p!=0 || (!hasFirst && !hasLast)) return -1;
+	if (!hasFirst) {
+		//Suffix range: the last n bytes.
+		if (*last==0) return 0;
+		*first=(*last>size)?0:size-*last;
+		*last=size-1;
+	} else if (!hasLast || *last>=size) {
+		*last=size-1;
+	}
+	if (*first>=size || *last<*first) return 0;
+	return 1;
+}
+
+typedef struct {
+	EspFsFile *file;
+	int left;
+} RangeData;
+
+//Sends the body of a 206 response. cgiEspFsHook hands the connection over to this after it has
+//sent the headers, as it has to keep track of the end of the range.
+static int ICACHE_FLASH_ATTR cgiEspFsRange(HttpdConnData *connData) {
+	RangeData *rd=connData->cgiData;
+	char *out;
+	const char *direct;
+	int len, n=-1;
+
+	if (connData->conn!=NULL && rd->left>0) {
+		direct=espFsDirect(rd->file, &len);
+		if (direct!=NULL) {
+			if (len>rd->left) len=rd->left;
+			n=httpdSendDirect(connData, direct, len);
+			if (n>0) espFsSkip(rd->file, n);
+		}
+		if (n<0) {
+			out=httpdSendReserve(connData, &len);
+			if (out==NULL) return HTTPD_CGI_MORE;
+			len&=~3; //See cgiEspFsHook.
+			if (len>rd->left) len=rd->left;
+			n=espFsRead(rd->file, out, len);
+			if (n>0) httpdSendCommit(connData, n);
+			if (n<=0 && len>0) rd->left=0; //Shouldn't happen; the range was checked against the file.
+			if (n<0) n=0;
+		}
+		rd->left-=n;
+		if (rd->left>0) return HTTPD_CGI_MORE;
+	}
+	espFsClose(rd->file);
+	free(rd);
+	return HTTPD_CGI_DONE;
+}
 
 //This is a catch-all cgi function. It takes the url passed to it, looks up the corresponding
 //path in the filesystem and if it exists, passes the file through. This simulates what a normal
@@ -27,9 +136,15 @@ static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nSe
 int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 	EspFsFile *file=connData->cgiData;
 	int len;
-	char buff[1024];
-	char acceptEncodingBuffer[64];
-	int isGzip;
+	char buff[256]; //For prebuilt headers and the Content-Range; the file goes straight into the send buffer.
+	const char *acceptEncoding;
+	int isGzip, hasEtag, sent;
+	char etag[ESPFS_HASH_LEN*2+3];
+	const char *direct;
+	char *out;
+	const char *range, *ifRange;
+	int size, first, last, r;
+	RangeData *rd;
 	
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
@@ -62,8 +177,8 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 		if (isGzip) {
 			// Check the browser's "Accept-Encoding" header. If the client does not
 			// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-			httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
-			if (strstr(acceptEncodingBuffer, "gzip") == NULL) {
+			acceptEncoding=httpdGetHeaderPtr(connData, "Accept-Encoding", NULL);
+			if (acceptEncoding==NULL || strstr(acceptEncoding, "gzip") == NULL) {
 				//No Accept-Encoding: gzip header present
 				httpdSend(connData, gzipNonSupportedMessage, -1);
 				espFsClose(file);
@@ -71,20 +186,118 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 			}
 		}
 
+		hasEtag=espFsEtag(file, etag);
+		if (hasEtag && etagMatches(connData, etag)) {
+			//Client has this version of the file already.
+			espFsClose(file);
+			httpdStartResponse(connData, 304);
+			httpdHeader(connData, "ETag", etag);
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
+		//Only files stored as-is or compressed in blocks can be seeked in, so only those get ranges.
+		//If-Range makes the Range conditional on the client's copy still being current; we can only
+		//check that by ETag.
+		range=httpdGetHeaderPtr(connData, "Range", NULL);
+		ifRange=httpdGetHeaderPtr(connData, "If-Range", NULL);
+		size=espFsFileSize(file);
+		if (range!=NULL && espFsSeek(file, 0)==0 &&
+				(ifRange==NULL || (hasEtag && strcmp(ifRange, etag)==0))) {
+			r=parseRange(range, size, &first, &last);
+			if (r==0) {
+				espFsClose(file);
+				sprintf(buff, "bytes */%d", size);
+				httpdSetContentLength(connData, 0);
+				httpdStartResponse(connData, 416);
+				httpdHeader(connData, "Content-Range", buff);
+				httpdEndHeaders(connData);
+				return HTTPD_CGI_DONE;
+			} else if (r==1) {
+				if (!espFsPrepare(file)) {
+					espFsClose(file);
+					return espFsBusy(connData);
+				}
+				//Get to the start of the range before promising it in the headers.
+				if (espFsSeek(file, first)!=first) {
+					httpd_printf("cgiEspFsHook: can't seek to %d in %s\n", first, connData->url);
+					espFsClose(file);
+					httpdSetContentLength(connData, 0);
+					httpdStartResponse(connData, 500);
+					httpdEndHeaders(connData);
+					return HTTPD_CGI_DONE;
+				}
+				rd=(RangeData *)malloc(sizeof(RangeData));
+				if (rd==NULL) {
+					espFsClose(file);
+					return HTTPD_CGI_DONE;
+				}
+				rd->file=file;
+				rd->left=last-first+1;
+				connData->cgiData=rd;
+				connData->cgi=cgiEspFsRange;
+				httpdSetContentLength(connData, rd->left);
+				httpdStartResponse(connData, 206);
+				httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+				if (isGzip) httpdHeader(connData, "Content-Encoding", "gzip");
+				if (hasEtag) httpdHeader(connData, "ETag", etag);
+				sprintf(buff, "bytes %d-%d/%d", first, last, size);
+				httpdHeader(connData, "Content-Range", buff);
+				httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+				httpdEndHeaders(connData);
+				return HTTPD_CGI_MORE;
+			}
+		}
+
+		//Only now that the body will be sent does the file need a decoder; the 304 and 416 above don't.
+		if (!espFsPrepare(file)) {
+			espFsClose(file);
+			return espFsBusy(connData);
+		}
 		connData->cgiData=file;
+		//We know exactly how much we'll send, so the connection can stay alive without chunking.
+		httpdSetContentLength(connData, size);
+		len=espFsHeaders(file, buff, sizeof(buff));
+		if (len>0) {
+			//mkespfsimage -p already put the headers together.
+			httpdStartResponseHeaders(connData, 200, buff, len);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_MORE;
+		}
 		httpdStartResponse(connData, 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
 		if (isGzip) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
 		}
+		if (hasEtag) httpdHeader(connData, "ETag", etag);
+		if (espFsSeek(file, 0)==0) httpdHeader(connData, "Accept-Ranges", "bytes");
 		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		httpdEndHeaders(connData);
 		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(file, buff, 1024);
-	if (len>0) httpdSend(connData, buff, len);
-	if (len!=1024) {
+	direct=espFsDirect(file, &len);
+	if (direct!=NULL) {
+		//Image is in memory: send straight from there, as much as the connection takes.
+		sent=httpdSendDirect(connData, direct, len);
+		if (sent>=0) {
+			espFsSkip(file, sent);
+			if (sent<len) return HTTPD_CGI_MORE;
+			espFsClose(file);
+			return HTTPD_CGI_DONE;
+		}
+	}
+
+	//Read the file straight into the send buffer. On the ESP, the flash is read in aligned words,
+	//which go straight in as long as the buffer and the file are aligned alike; reading whole words
+	//every time keeps them that way.
+	out=httpdSendReserve(connData, &len);
+	if (out==NULL) return HTTPD_CGI_MORE;
+	len&=~3;
+	sent=espFsRead(file, out, len);
+	if (sent>0) httpdSendCommit(connData, sent);
+	if (sent!=len) {
 		//We're done.
 		espFsClose(file);
 		return HTTPD_CGI_DONE;
@@ -129,8 +342,8 @@ int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 		tpd->tplArg=NULL;
 		tpd->tokenPos=-1;
 		if (tpd->file==NULL) {
-			espFsClose(tpd->file);
 			free(tpd);
+			connData->cgiData=NULL;
 			return HTTPD_CGI_NOTFOUND;
 		}
 		if (espFsFlags(tpd->file) & FLAG_GZIP) {
@@ -139,6 +352,12 @@ int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 			free(tpd);
 			return HTTPD_CGI_NOTFOUND;
 		}
+		if (!espFsPrepare(tpd->file)) {
+			espFsClose(tpd->file);
+			free(tpd);
+			connData->cgiData=NULL;
+			return espFsBusy(connData);
+		}
 		connData->cgiData=tpd;
 		httpdStartResponse(connData, 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
@@ -21,33 +21,134 @@ It's written for use with httpd, but doesn't need to be used as such.
 #ifdef __ets__
 //esp build
 #include <esp8266.h>
+//Integer version of a pointer into the image, as spi_flash_read wants it
+#define FLASH_ADDR(p) ((uint32)(p))
 #else
-//Test build
+//Test build, or the native HTTPD_POSIX build. The image is mmap'ed, so 'flash' is plain memory.
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #define ICACHE_FLASH_ATTR
+typedef uint32_t uint32;
+#define FLASH_ADDR(p) ((uintptr_t)(p))
+#define spi_flash_read(src, dst, len) memcpy((dst), (void*)(src), (len))
+#ifdef HTTPD_POSIX_DEBUG
+#define httpd_printf(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+#define httpd_printf(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while(0)
+#endif
 #endif
 
 #include "espfsformat.h"
 #include "espfs.h"
 
+//Files can be opened, read and closed by more than one task at the same time: the httpd runs cgis from
+//other tasks through httpdContinue. The decoder pool and the cache are shared between all files, so
+//they're only touched while holding this lock. Nothing that takes another lock is called while holding it.
+#if defined(FREERTOS)
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+static xQueueHandle espFsMux;
+#define espFsLock() xSemaphoreTake(espFsMux, portMAX_DELAY)
+#define espFsUnlock() xSemaphoreGive(espFsMux)
+#elif defined(HTTPD_POSIX)
+#include <pthread.h>
+static pthread_mutex_t espFsMux=PTHREAD_MUTEX_INITIALIZER;
+#define espFsLock() pthread_mutex_lock(&espFsMux)
+#define espFsUnlock() pthread_mutex_unlock(&espFsMux)
+#else
+//The non-os SDK and the test tools only run one task.
+#define espFsLock()
+#define espFsUnlock()
+#endif
+
 #ifdef ESPFS_HEATSHRINK
 #include "heatshrink_config_custom.h"
 #include "heatshrink_decoder.h"
+
+//Size of the input buffer of the heatshrink decoder, and so of the blocks of compressed data that are
+//read from flash and fed to it. Larger blocks mean fewer flash reads and decoder calls, at the cost of
+//this much RAM for every open compressed file. Keep it a multiple of 4.
+#ifndef ESPFS_HEATSHRINK_INPUT_SIZE
+#define ESPFS_HEATSHRINK_INPUT_SIZE 64
+#endif
+
+//Decoders come from a fixed pool instead of the heap, so serving a compressed file can't fail on a
+//fragmented heap. Every connection of the httpd can have one file open, so by default there's a
+//decoder for each. The window of every decoder is big enough for files compressed with the largest
+//window given here; mkespfsimage uses 11 bits (2K) unless asked for a higher level.
+#ifndef ESPFS_HEATSHRINK_DECODERS
+#ifdef HTTPD_MAX_CONNECTIONS
+#define ESPFS_HEATSHRINK_DECODERS HTTPD_MAX_CONNECTIONS
+#else
+#define ESPFS_HEATSHRINK_DECODERS 4
+#endif
+#endif
+#ifndef ESPFS_HEATSHRINK_WINDOW_BITS
+#define ESPFS_HEATSHRINK_WINDOW_BITS 11
+#endif
+
+//The window and input buffer size of the decoders are set per file, which needs the dynamic layout.
+#if !HEATSHRINK_DYNAMIC_ALLOC
+#error "espfs needs HEATSHRINK_DYNAMIC_ALLOC in heatshrink_config_custom.h"
+#endif
+
+#define DECODER_WORDS ((sizeof(heatshrink_decoder)+(1<<ESPFS_HEATSHRINK_WINDOW_BITS)+ESPFS_HEATSHRINK_INPUT_SIZE+3)/4)
+static uint32_t decoderMem[ESPFS_HEATSHRINK_DECODERS][DECODER_WORDS];
+static char decoderUsed[ESPFS_HEATSHRINK_DECODERS];
 #endif
 
 static char* espFsData = NULL;
+//Directory of a version 2 image, NULL for an older one.
+static char* espFsDir = NULL;
+static int espFsDirCount = 0;
+//Copy of the directory in RAM, made by espFsBuildIndex. Used instead of espFsDir if it's there.
+static EspFsDirEntry* espFsIndex = NULL;
+
+//Optional cache of the contents of small files in RAM, set up with espFsCacheInit. Files in it are
+//read from RAM without touching flash or needing a decoder; it's meant for the handful of small files
+//that get requested all the time, like index.html. The list is kept in most recently used order; the
+//least recently used entries that no open file reads from are dropped to make room.
+typedef struct EspFsCacheEntry EspFsCacheEntry;
+struct EspFsCacheEntry {
+	char *start;			//Start of the file data in the image, which identifies it
+	int len;
+	int refs;				//Amount of open files reading from this entry
+	EspFsCacheEntry *next;
+	char data[];
+};
+
+static EspFsCacheEntry *espFsCache = NULL;
+static int espFsCacheMax = 0;
+static int espFsCacheMaxFile = 0;
+static EspFsCacheStats cacheStats;
 
 
 struct EspFsFile {
-	EspFsHeader *header;
+	//Copied from the header, so they don't need to be read from flash every time.
+	int8_t flags;
+	int32_t fileLenComp;
+	int32_t fileLenDecomp;
 	char decompressor;
 	int32_t posDecomp;
 	char *posStart;
 	char *posComp;
+	char *posCompEnd;	//End of the compressed data the decoder is fed: that of the file, or of the current block
 	void *decompData;
+	char *headers;		//Prebuilt response header block, or NULL
+	char ready;			//Set by espFsPrepare once the file has its decoder, or is read from the cache
+	char counted;		//Set once the file has counted as a cache hit or miss
+	EspFsCacheEntry *cache;	//Cached contents the file is read from, or NULL. posDecomp is the position in it.
+	//For COMPRESS_HEATSHRINK_BLOCKS: log2 of the block size, the amount of blocks, and the position
+	//in the decompressed file the block being decoded ends at. The latter is the file length otherwise.
+	char blockShift;
+	int blockCount;
+	int32_t blockEndDecomp;
+	//Heatshrink window and lookahead the file was compressed with.
+	char windowBits;
+	char lookaheadBits;
 };
 
 /*
@@ -74,39 +175,119 @@ a memory exception, crashing the program.
 #define FLASH_BASE_ADDR 0x40040000
 #endif
 
+//Drop the least recently used cache entries that aren't in use until the cache takes at most maxBytes.
+//Call with the lock held.
+static void ICACHE_FLASH_ATTR espFsCacheShrink(int maxBytes) {
+	EspFsCacheEntry **pe, **victim, *e;
+	while ((int)cacheStats.bytes>maxBytes) {
+		victim=NULL;
+		for (pe=&espFsCache; *pe!=NULL; pe=&(*pe)->next) {
+			if ((*pe)->refs==0) victim=pe;
+		}
+		if (victim==NULL) return; //Everything left is being read from.
+		e=*victim;
+		*victim=e->next;
+		cacheStats.bytes-=e->len;
+		cacheStats.files--;
+		cacheStats.evictions++;
+		free(e);
+	}
+}
+
+//Set up the file cache: keep the contents of files of at most maxFileBytes (after decompression) in
+//RAM, up to maxBytes in total. 0 turns the cache off. Entries that don't fit the new budget are dropped
+//as soon as they're not in use.
+void ICACHE_FLASH_ATTR espFsCacheInit(int maxBytes, int maxFileBytes) {
+	espFsLock();
+	espFsCacheMax=maxBytes;
+	espFsCacheMaxFile=maxFileBytes;
+	espFsCacheShrink(maxBytes);
+	espFsUnlock();
+}
+
+//Returns the counters of the file cache.
+const EspFsCacheStats ICACHE_FLASH_ATTR *espFsGetCacheStats() {
+	return &cacheStats;
+}
+
 EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
+#ifdef __ets__
 	if((uint32_t)flashAddress > 0x40000000) {
 		flashAddress = (void*)((uint32_t)flashAddress-FLASH_BASE_ADDR);
 	}
+#endif
 
 	// base address must be aligned to 4 bytes
-	if (((int)flashAddress & 3) != 0) {
+	if ((FLASH_ADDR(flashAddress) & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
 	}
 
 	// check if there is valid header at address
 	EspFsHeader testHeader;
-	spi_flash_read((uint32)flashAddress, (uint32*)&testHeader, sizeof(EspFsHeader));
+	spi_flash_read(FLASH_ADDR(flashAddress), (uint32*)&testHeader, sizeof(EspFsHeader));
 	if (testHeader.magic != ESPFS_MAGIC) {
 		return ESPFS_INIT_RESULT_NO_IMAGE;
 	}
 
+#ifdef FREERTOS
+	if (espFsMux==NULL) espFsMux=xSemaphoreCreateMutex();
+#endif
 	espFsData = (char *)flashAddress;
+	espFsLock();
+	espFsCacheShrink(0);
+	espFsUnlock();
+	espFsDir = NULL;
+	espFsDirCount = 0;
+	if (espFsIndex != NULL) free(espFsIndex);
+	espFsIndex = NULL;
+	if (testHeader.flags & FLAG_DIRECTORY) {
+		espFsDir = espFsData+sizeof(EspFsHeader)+testHeader.nameLen;
+		espFsDirCount = testHeader.fileLenComp/sizeof(EspFsDirEntry);
+	}
 	return ESPFS_INIT_RESULT_OK;
 }
 
-//Copies len bytes over from dst to src, but does it using *only*
-//aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
-
-//ToDo: perhaps memcpy also does unaligned accesses?
+//Copies len bytes from src in flash to dst. Flash can only be read in aligned 32-bit words, so the
+//unaligned bytes at the start and the end are read through a single word; everything in between is
+//read straight into dst, or through a small buffer if dst isn't aligned.
 #ifdef __ets__
+#define FLASH_BOUNCE_WORDS 16
 void ICACHE_FLASH_ATTR readFlashUnaligned(char *dst, char *src, int len) {
-	uint8_t src_offset = ((uint32_t)src) & 3;
-	uint32_t src_address = ((uint32_t)src) - src_offset;
-
-	uint32_t tmp_buf[len/4 + 2];
-	spi_flash_read((uint32)src_address, (uint32*)tmp_buf, len+src_offset);
-	memcpy(dst, ((uint8_t*)tmp_buf)+src_offset, len);
+	uint32_t addr=(uint32_t)src;
+	uint32_t word;
+	uint32_t bounce[FLASH_BOUNCE_WORDS];
+	int n;
+
+	if (addr&3) {
+		spi_flash_read(addr&~3, &word, 4);
+		n=4-(addr&3);
+		if (n>len) n=len;
+		memcpy(dst, ((char*)&word)+(addr&3), n);
+		dst+=n;
+		addr+=n;
+		len-=n;
+	}
+	if (((uint32_t)dst&3)==0) {
+		n=len&~3;
+		if (n>0) spi_flash_read(addr, (uint32*)dst, n);
+		dst+=n;
+		addr+=n;
+		len-=n;
+	} else {
+		while (len>=4) {
+			n=len&~3;
+			if (n>sizeof(bounce)) n=sizeof(bounce);
+			spi_flash_read(addr, bounce, n);
+			memcpy(dst, bounce, n);
+			dst+=n;
+			addr+=n;
+			len-=n;
+		}
+	}
+	if (len>0) {
+		spi_flash_read(addr, &word, 4);
+		memcpy(dst, &word, len);
+	}
 }
 #else
 #define readFlashUnaligned memcpy
@@ -119,9 +300,500 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 		return -1;
 	}
 
-	int8_t flags;
-	readFlashUnaligned((char*)&flags, (char*)&fh->header->flags, 1);
-	return (int)flags;
+	return (int)fh->flags;
+}
+
+//Returns the amount of bytes espFsRead will return for the file in total. For files that are
+//stored gzip'ed, that's the size of the gzip data, because that's what gets read.
+int ICACHE_FLASH_ATTR espFsFileSize(EspFsFile *fh) {
+	if (fh==NULL) return -1;
+	return (fh->decompressor==COMPRESS_NONE)?fh->fileLenComp:fh->fileLenDecomp;
+}
+
+//Copies the content hash mkespfsimage stored for the file into hash, which needs to hold
+//ESPFS_HASH_LEN bytes. Returns 0 if the file doesn't have a hash.
+int ICACHE_FLASH_ATTR espFsHash(EspFsFile *fh, char *hash) {
+	if (fh==NULL || !(espFsFlags(fh)&FLAG_HASH)) return 0;
+	readFlashUnaligned(hash, fh->posStart-ESPFS_HASH_LEN, ESPFS_HASH_LEN);
+	return 1;
+}
+
+//Copies the block of response header lines mkespfsimage -p built for the file into buff. Returns its
+//length, or 0 if the file doesn't have one or it doesn't fit in len bytes.
+int ICACHE_FLASH_ATTR espFsHeaders(EspFsFile *fh, char *buff, int len) {
+	uint16_t hlen;
+	if (fh==NULL || fh->headers==NULL) return 0;
+	readFlashUnaligned((char*)&hlen, fh->headers, 2);
+	if (hlen>len) return 0;
+	readFlashUnaligned(buff, fh->headers+2, hlen);
+	return hlen;
+}
+
+//Count file fh, which is read from the cache, as a hit the first time data is taken from it.
+static void ICACHE_FLASH_ATTR espFsCacheHit(EspFsFile *fh) {
+	if (fh->counted) return;
+	fh->counted=1;
+	espFsLock();
+	cacheStats.hits++;
+	espFsUnlock();
+}
+
+//Returns a pointer to the rest of the file in the image and puts its length in *len, so it can be
+//sent without copying it somewhere first; use espFsSkip to move past the part that was used. Only
+//works for files in the RAM cache, and for files stored as-is (gzipped ones included) in an image
+//that is plain memory, like the mmap'ed one of a native build. Returns NULL otherwise.
+const char ICACHE_FLASH_ATTR *espFsDirect(EspFsFile *fh, int *len) {
+	if (!espFsPrepare(fh)) return NULL;
+	if (fh->cache!=NULL) {
+		espFsCacheHit(fh);
+		*len=fh->cache->len-fh->posDecomp;
+		return fh->cache->data+fh->posDecomp;
+	}
+#ifdef __ets__
+	//Memory-mapped flash on the ESP only allows aligned 32-bit reads, while the network stack
+	//copies data out of the pointers it gets with byte accesses.
+	return NULL;
+#else
+	if (fh->decompressor!=COMPRESS_NONE) return NULL;
+	*len=fh->fileLenComp-(fh->posComp-fh->posStart);
+	return fh->posComp;
+#endif
+}
+
+//Moves the read position of a cached file or one stored as-is len bytes forward. Returns how far it moved.
+int ICACHE_FLASH_ATTR espFsSkip(EspFsFile *fh, int len) {
+	int left;
+	if (!espFsPrepare(fh)) return 0;
+	if (fh->cache!=NULL) {
+		if (len>fh->cache->len-fh->posDecomp) len=fh->cache->len-fh->posDecomp;
+		fh->posDecomp+=len;
+		return len;
+	}
+	if (fh->decompressor!=COMPRESS_NONE) return 0;
+	left=fh->fileLenComp-(fh->posComp-fh->posStart);
+	if (len>left) len=left;
+	fh->posComp+=len;
+	fh->posDecomp+=len;
+	return len;
+}
+
+#ifdef ESPFS_HEATSHRINK
+//Start decoding block b of a COMPRESS_HEATSHRINK_BLOCKS file. Its compressed data runs from its
+//offset in the table to the offset of the next block, or the end of the file for the last one.
+//Returns 0 if the file doesn't have that block or its table is broken.
+static int ICACHE_FLASH_ATTR espFsStartBlock(EspFsFile *fh, int b) {
+	uint32_t off[2];
+	char *table=fh->posStart+sizeof(EspFsBlockHeader);
+	if (b<0 || b>=fh->blockCount) return 0;
+	if (b+1<fh->blockCount) {
+		readFlashUnaligned((char*)off, table+b*4, 8);
+	} else {
+		readFlashUnaligned((char*)off, table+b*4, 4);
+		off[1]=fh->fileLenComp;
+	}
+	if (off[0]>off[1] || off[1]>fh->fileLenComp) return 0;
+	fh->posComp=fh->posStart+off[0];
+	fh->posCompEnd=fh->posStart+off[1];
+	fh->posDecomp=b<<fh->blockShift;
+	fh->blockEndDecomp=(b+1)<<fh->blockShift;
+	if (fh->blockEndDecomp>fh->fileLenDecomp) fh->blockEndDecomp=fh->fileLenDecomp;
+	heatshrink_decoder_reset((heatshrink_decoder *)fh->decompData);
+	return 1;
+}
+#endif
+
+//Sets the read position of a file to pos bytes from its start. Gzipped files count as stored as-is:
+//their bytes are sent as they are, so seeking in those is fine. Files compressed in blocks are
+//decoded from the start of the block pos is in, so that takes decoding at most one block. Returns pos,
+//or -1 if the file can't be seeked in or pos lies beyond its end. Files in the cache can always be
+//seeked in. Seeking doesn't take a decoder; the first read does.
+int ICACHE_FLASH_ATTR espFsSeek(EspFsFile *fh, int pos) {
+	if (fh==NULL) return -1;
+	if (fh->cache!=NULL) {
+		if (pos<0 || pos>fh->cache->len) return -1;
+		fh->posDecomp=pos;
+		return pos;
+	}
+	if (!fh->ready) {
+		//Only remember the position; espFsPrepare moves there once the file is set up.
+		if (fh->decompressor!=COMPRESS_NONE && fh->decompressor!=COMPRESS_HEATSHRINK_BLOCKS) return -1;
+		if (pos<0 || pos>espFsFileSize(fh)) return -1;
+		fh->posDecomp=pos;
+		return pos;
+	}
+#ifdef ESPFS_HEATSHRINK
+	if (fh->decompressor==COMPRESS_HEATSHRINK_BLOCKS) {
+		char skip[128];
+		int n;
+		if (pos<0 || pos>fh->fileLenDecomp) return -1;
+		if (pos==fh->fileLenDecomp) {
+			//Nothing left to read; espFsRead checks for this before touching the decoder.
+			fh->posDecomp=pos;
+			return pos;
+		}
+		//Within the current block and ahead of where we are, decoding on is enough.
+		if (pos<fh->posDecomp || pos>=fh->blockEndDecomp) {
+			if (!espFsStartBlock(fh, pos>>fh->blockShift)) return -1;
+		}
+		while (fh->posDecomp<pos) {
+			n=pos-fh->posDecomp;
+			if (n>sizeof(skip)) n=sizeof(skip);
+			if (espFsRead(fh, skip, n)!=n) return -1;
+		}
+		return pos;
+	}
+#endif
+	if (fh->decompressor!=COMPRESS_NONE) return -1;
+	if (pos<0 || pos>fh->fileLenComp) return -1;
+	fh->posComp=fh->posStart+pos;
+	fh->posDecomp=pos;
+	return pos;
+}
+
+#ifdef ESPFS_HEATSHRINK
+//Take a decoder from the pool and set it up for the given window and lookahead, which espFsOpen
+//checked. Returns NULL if all decoders are in use.
+static heatshrink_decoder ICACHE_FLASH_ATTR *espFsGetDecoder(int windowBits, int lookaheadBits) {
+	heatshrink_decoder *dec;
+	int i;
+	espFsLock();
+	for (i=0; i<ESPFS_HEATSHRINK_DECODERS; i++) {
+		if (decoderUsed[i]) continue;
+		decoderUsed[i]=1;
+		break;
+	}
+	espFsUnlock();
+	if (i==ESPFS_HEATSHRINK_DECODERS) {
+		httpd_printf("All %d heatshrink decoders in use.\n", ESPFS_HEATSHRINK_DECODERS);
+		return NULL;
+	}
+	dec=heatshrink_decoder_init(decoderMem[i], sizeof(decoderMem[i]), ESPFS_HEATSHRINK_INPUT_SIZE, windowBits, lookaheadBits);
+	if (dec==NULL) {
+		espFsLock();
+		decoderUsed[i]=0;
+		espFsUnlock();
+	}
+	return dec;
+}
+
+static void ICACHE_FLASH_ATTR espFsPutDecoder(heatshrink_decoder *dec) {
+	espFsLock();
+	decoderUsed[((uint32_t *)dec-decoderMem[0])/DECODER_WORDS]=0;
+	espFsUnlock();
+}
+#endif
+
+//Have the file read from cache entry e from now on; the caller already counted it in e->refs. It
+//doesn't need its decoder anymore then.
+static void ICACHE_FLASH_ATTR espFsCacheAttach(EspFsFile *r, EspFsCacheEntry *e) {
+#ifdef ESPFS_HEATSHRINK
+	if (r->decompData!=NULL) espFsPutDecoder((heatshrink_decoder *)r->decompData);
+	r->decompData=NULL;
+#endif
+	r->cache=e;
+	r->posDecomp=0;
+}
+
+//Look up the file with its data at start in the cache, and make it the most recently used entry. Files
+//that are links to the same data share the entry. Call with the lock held.
+static EspFsCacheEntry ICACHE_FLASH_ATTR *espFsCacheFind(char *start) {
+	EspFsCacheEntry **pe, *e;
+	for (pe=&espFsCache; *pe!=NULL; pe=&(*pe)->next) {
+		if ((*pe)->start!=start) continue;
+		e=*pe;
+		*pe=e->next;
+		e->next=espFsCache;
+		espFsCache=e;
+		return e;
+	}
+	return NULL;
+}
+
+//Have file r read from the cache if it's in there. Returns 1 if it is. It only counts as a hit once
+//data is taken from it (see espFsCacheHit), so opens that end in a 304 or 416 don't count.
+static int ICACHE_FLASH_ATTR espFsCacheLookup(EspFsFile *r) {
+	EspFsCacheEntry *e;
+	if (espFsCacheMax==0) return 0;
+	espFsLock();
+	e=espFsCacheFind(r->posStart);
+	if (e!=NULL) {
+		e->refs++;
+	}
+	espFsUnlock();
+	if (e==NULL) return 0;
+	espFsCacheAttach(r, e);
+	return 1;
+}
+
+//Move the read position of file r, which has its decoder if it needs one, back to the start.
+static void ICACHE_FLASH_ATTR espFsRewind(EspFsFile *r) {
+	r->posDecomp=0;
+	r->posComp=r->posStart;
+#ifdef ESPFS_HEATSHRINK
+	if (r->decompressor==COMPRESS_HEATSHRINK) {
+		r->posComp++; //Skip the decoder params.
+		heatshrink_decoder_reset((heatshrink_decoder *)r->decompData);
+	} else if (r->decompressor==COMPRESS_HEATSHRINK_BLOCKS && !espFsStartBlock(r, 0)) {
+		r->posCompEnd=r->posComp; //Nothing to decode, so reads end right away.
+	}
+#endif
+}
+
+//Read file r, which is at its start, into the cache if it's small enough, making room if needed.
+//Every file that gets here counts as a miss, including the ones too large for the cache.
+static void ICACHE_FLASH_ATTR espFsCacheFill(EspFsFile *r) {
+	EspFsCacheEntry *e, *o;
+	int len=espFsFileSize(r);
+	int full;
+	espFsLock();
+	cacheStats.misses++;
+	r->counted=1;
+	full=(len>espFsCacheMaxFile || len>espFsCacheMax);
+	if (!full) {
+		espFsCacheShrink(espFsCacheMax-len);
+		full=((int)cacheStats.bytes+len>espFsCacheMax); //Files that are being read fill it up.
+	}
+	espFsUnlock();
+	if (full) return;
+	e=(EspFsCacheEntry *)malloc(sizeof(EspFsCacheEntry)+len);
+	if (e==NULL) return;
+	//Reading takes a while, so it's done without the lock. Another task may be making room for a
+	//file at the same time, which can take the cache a bit over budget until the next shrink.
+	if (espFsRead(r, e->data, len)!=len) {
+		//Broken file; leave it to be read the normal way, from the start.
+		free(e);
+		espFsRewind(r);
+		return;
+	}
+	e->start=r->posStart;
+	e->len=len;
+	e->refs=1;
+	espFsLock();
+	//Another task may have read the same file into the cache meanwhile; use that one then.
+	o=espFsCacheFind(r->posStart);
+	if (o!=NULL) {
+		o->refs++;
+	} else {
+		e->next=espFsCache;
+		espFsCache=e;
+		cacheStats.bytes+=len;
+		cacheStats.files++;
+	}
+	espFsUnlock();
+	if (o!=NULL) {
+		free(e);
+		e=o;
+	}
+	espFsCacheAttach(r, e);
+}
+
+//Get the file ready to be read: take a decoder for a compressed file, and read the file into the
+//cache if it's small enough. espFsRead, espFsSeek, espFsDirect and espFsSkip do this by themselves
+//when needed; call it first to find out if a file can be served before committing to it. Opening a
+//file doesn't take a decoder, so the flags, hash, size and headers of a file can always be looked at.
+//Returns 0 if all decoders are in use, so trying again later may work; 1 otherwise.
+int ICACHE_FLASH_ATTR espFsPrepare(EspFsFile *fh) {
+	int pos;
+	if (fh==NULL) return 0;
+	if (fh->ready || fh->cache!=NULL) return 1;
+	//A seek done before this is kept in posDecomp; the file is set up at its start and moved there after.
+	pos=fh->posDecomp;
+	//Another file may have read it into the cache since this one was opened.
+	if (espFsCacheLookup(fh)) {
+		if (pos!=0) espFsSeek(fh, pos);
+		return 1;
+	}
+#ifdef ESPFS_HEATSHRINK
+	if (fh->decompressor!=COMPRESS_NONE) {
+		fh->decompData=espFsGetDecoder(fh->windowBits, fh->lookaheadBits);
+		if (fh->decompData==NULL) return 0;
+	}
+#endif
+	espFsRewind(fh);
+	fh->ready=1;
+	if (espFsCacheMax>0) espFsCacheFill(fh);
+	if (pos!=0) espFsSeek(fh, pos);
+	return 1;
+}
+
+//Make a file desc struct for the file with the header h at hpos. nameLen is the length of its
+//name, including the terminating zero.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenHeader(char *hpos, EspFsHeader *h, int nameLen) {
+	EspFsFile *r;
+	char *p=hpos+sizeof(EspFsHeader)+h->nameLen; //Skip to content.
+	if (h->flags&FLAG_LINK) {
+		//The data is that of an earlier file. Its header has the compression and lengths; the
+		//distance back to it is stored right before the hash.
+		uint32_t back;
+		EspFsHeader th;
+		readFlashUnaligned((char*)&back, p-((h->flags&FLAG_HASH)?ESPFS_HASH_LEN:0)-4, 4);
+		spi_flash_read(FLASH_ADDR(hpos-back), (uint32*)&th, sizeof(EspFsHeader));
+		if (th.magic!=ESPFS_MAGIC || (th.flags&FLAG_LINK)) {
+			httpd_printf("Bad link in espfs image.\n");
+			return NULL;
+		}
+		p=hpos-back+sizeof(EspFsHeader)+th.nameLen;
+		h->compression=th.compression;
+		h->fileLenComp=th.fileLenComp;
+		h->fileLenDecomp=th.fileLenDecomp;
+	}
+	r=(EspFsFile *)malloc(sizeof(EspFsFile)); //Alloc file desc mem
+//	httpd_printf("Alloc %p\n", r);
+	if (r==NULL) return NULL;
+	r->flags=h->flags;
+	r->fileLenComp=h->fileLenComp;
+	r->fileLenDecomp=h->fileLenDecomp;
+	r->decompressor=h->compression;
+	r->posComp=p;
+	r->posStart=p;
+	r->posCompEnd=p+h->fileLenComp;
+	r->posDecomp=0;
+	r->blockEndDecomp=h->fileLenDecomp;
+	r->headers=NULL;
+	r->cache=NULL;
+	r->decompData=NULL;
+	r->ready=0;
+	r->counted=0;
+	if (h->flags&FLAG_HEADERS) {
+		//Block starts after the name, padded to 32 bit.
+		r->headers=hpos+sizeof(EspFsHeader)+((nameLen+3)&~3);
+	}
+	if (espFsCacheLookup(r)) return r;
+	if (h->compression!=COMPRESS_NONE
+#ifdef ESPFS_HEATSHRINK
+			&& h->compression!=COMPRESS_HEATSHRINK && h->compression!=COMPRESS_HEATSHRINK_BLOCKS
+#endif
+			) {
+		httpd_printf("Invalid compression: %d\n", h->compression);
+		free(r);
+		return NULL;
+	}
+#ifdef ESPFS_HEATSHRINK
+	if (h->compression!=COMPRESS_NONE) {
+		//Decoder params are stored in the 1st byte; for files compressed in blocks, that's the first
+		//byte of the block header, which also has the block size and count espFsSeek needs.
+		EspFsBlockHeader bh;
+		readFlashUnaligned((char*)&bh, r->posComp, (h->compression==COMPRESS_HEATSHRINK)?1:sizeof(bh));
+		httpd_printf("Heatshrink compressed file; decode parms = %x\n", bh.parm);
+		r->windowBits=(bh.parm>>4)&0xf;
+		r->lookaheadBits=bh.parm&0xf;
+		r->blockShift=bh.blockShift;
+		r->blockCount=bh.blockCount;
+		//Check now whether the decoders can handle it, so espFsPrepare only fails when they're busy.
+		if (r->windowBits>ESPFS_HEATSHRINK_WINDOW_BITS || r->windowBits<HEATSHRINK_MIN_WINDOW_BITS ||
+				r->lookaheadBits<HEATSHRINK_MIN_LOOKAHEAD_BITS || r->lookaheadBits>=r->windowBits) {
+			httpd_printf("Heatshrink window of %d bits doesn't fit; raise ESPFS_HEATSHRINK_WINDOW_BITS.\n", r->windowBits);
+			free(r);
+			return NULL;
+		}
+	}
+#endif
+	return r;
+}
+
+//32-bit FNV-1a of a file name, as mkespfsimage uses for the directory.
+static uint32_t ICACHE_FLASH_ATTR espFsNameHash(const char *name) {
+	uint32_t h=2166136261U;
+	while (*name) h=(h^(uint8_t)*name++)*16777619U;
+	return h;
+}
+
+static void ICACHE_FLASH_ATTR espFsGetDirEntry(int i, EspFsDirEntry *e) {
+	if (espFsIndex!=NULL) {
+		*e=espFsIndex[i];
+	} else {
+		spi_flash_read(FLASH_ADDR(espFsDir+i*sizeof(EspFsDirEntry)), (uint32*)e, sizeof(EspFsDirEntry));
+	}
+}
+
+//Build a copy of the directory in RAM, so opening a file (or finding it isn't there) only takes
+//reading its header and name from flash. For images without a directory, this goes through the
+//image once to make one. The index takes 8 bytes per file; it isn't built if that's more than
+//maxBytes. Returns the size of the index, or 0 if there is none.
+int ICACHE_FLASH_ATTR espFsBuildIndex(int maxBytes) {
+	char *p, *hpos;
+	char namebuf[256];
+	EspFsHeader h;
+	EspFsDirEntry e;
+	int count=0, i, j, size;
+
+	if (espFsIndex!=NULL) return espFsDirCount*sizeof(EspFsDirEntry);
+	if (espFsData==NULL) return 0;
+	if (espFsDir==NULL) {
+		//Count the files first, to know if the index fits.
+		p=espFsData;
+		while (1) {
+			spi_flash_read(FLASH_ADDR(p), (uint32*)&h, sizeof(EspFsHeader));
+			if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE)) break;
+			count++;
+			p+=sizeof(EspFsHeader)+h.nameLen+h.fileLenComp;
+			if (FLASH_ADDR(p)&3) p+=4-(FLASH_ADDR(p)&3);
+		}
+	} else {
+		count=espFsDirCount;
+	}
+	size=count*sizeof(EspFsDirEntry);
+	if (count==0 || size>maxBytes) {
+		httpd_printf("Espfs index of %d bytes is over the budget of %d bytes; not building it.\n", size, maxBytes);
+		return 0;
+	}
+	espFsIndex=(EspFsDirEntry *)malloc(size);
+	if (espFsIndex==NULL) return 0;
+
+	if (espFsDir!=NULL) {
+		//Already sorted; just copy it.
+		spi_flash_read(FLASH_ADDR(espFsDir), (uint32*)espFsIndex, size);
+	} else {
+		p=espFsData;
+		for (i=0; i<count; i++) {
+			hpos=p;
+			spi_flash_read(FLASH_ADDR(p), (uint32*)&h, sizeof(EspFsHeader));
+			spi_flash_read(FLASH_ADDR(p+sizeof(EspFsHeader)), (uint32*)&namebuf, sizeof(namebuf));
+			namebuf[sizeof(namebuf)-1]=0;
+			e.hash=espFsNameHash(namebuf);
+			e.offset=hpos-espFsData;
+			//Insertion sort on hash; this only runs once, on a few hundred files at most.
+			for (j=i; j>0 && espFsIndex[j-1].hash>e.hash; j--) espFsIndex[j]=espFsIndex[j-1];
+			espFsIndex[j]=e;
+			p+=sizeof(EspFsHeader)+h.nameLen+h.fileLenComp;
+			if (FLASH_ADDR(p)&3) p+=4-(FLASH_ADDR(p)&3);
+		}
+		espFsDirCount=count;
+	}
+	httpd_printf("Espfs index: %d files, %d bytes.\n", count, size);
+	return size;
+}
+
+//Find a file using the directory of a version 2 image or the RAM index: a binary search on the hash of the name,
+//then a check of the name of the file(s) with that hash. That's a handful of small flash reads
+//instead of two for every file before it in the image.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenDir(char *fileName) {
+	uint32_t hash=espFsNameHash(fileName);
+	int lo=0, hi=espFsDirCount, mid;
+	int nameLen=strlen(fileName)+1;
+	EspFsDirEntry e;
+	EspFsHeader h;
+	char *hpos;
+	char namebuf[256];
+
+	if (nameLen>sizeof(namebuf)) return NULL;
+	while (lo<hi) {
+		mid=(lo+hi)/2;
+		espFsGetDirEntry(mid, &e);
+		if (e.hash<hash) lo=mid+1; else hi=mid;
+	}
+	for (; lo<espFsDirCount; lo++) {
+		espFsGetDirEntry(lo, &e);
+		if (e.hash!=hash) break;
+		hpos=espFsData+e.offset;
+		spi_flash_read(FLASH_ADDR(hpos), (uint32*)&h, sizeof(EspFsHeader));
+		//Only read as much of the name as needed to compare it, rounded up for the flash.
+		spi_flash_read(FLASH_ADDR(hpos+sizeof(EspFsHeader)), (uint32*)&namebuf, (nameLen+3)&~3);
+		if (h.magic==ESPFS_MAGIC && memcmp(namebuf, fileName, nameLen)==0) {
+			return espFsOpenHeader(hpos, &h, nameLen);
+		}
+	}
+	return NULL;
 }
 
 //Open a file and return a pointer to the file desc struct.
@@ -134,14 +806,14 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 	char *hpos;
 	char namebuf[256];
 	EspFsHeader h;
-	EspFsFile *r;
 	//Strip initial slashes
 	while(fileName[0]=='/') fileName++;
-	//Go find that file!
+	if (espFsDir!=NULL || espFsIndex!=NULL) return espFsOpenDir(fileName);
+	//No directory, so go through the files one by one.
 	while(1) {
 		hpos=p;
 		//Grab the next file header.
-		spi_flash_read((uint32)p, (uint32*)&h, sizeof(EspFsHeader));
+		spi_flash_read(FLASH_ADDR(p), (uint32*)&h, sizeof(EspFsHeader));
 
 		if (h.magic!=ESPFS_MAGIC) {
 			httpd_printf("Magic mismatch. EspFS image broken.\n");
@@ -153,56 +825,37 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 		}
 		//Grab the name of the file.
 		p+=sizeof(EspFsHeader); 
-		spi_flash_read((uint32)p, (uint32*)&namebuf, sizeof(namebuf));
+		spi_flash_read(FLASH_ADDR(p), (uint32*)&namebuf, sizeof(namebuf));
 //		httpd_printf("Found file '%s'. Namelen=%x fileLenComp=%x, compr=%d flags=%d\n", 
 //				namebuf, (unsigned int)h.nameLen, (unsigned int)h.fileLenComp, h.compression, h.flags);
 		if (strcmp(namebuf, fileName)==0) {
 			//Yay, this is the file we need!
-			p+=h.nameLen; //Skip to content.
-			r=(EspFsFile *)malloc(sizeof(EspFsFile)); //Alloc file desc mem
-//			httpd_printf("Alloc %p\n", r);
-			if (r==NULL) return NULL;
-			r->header=(EspFsHeader *)hpos;
-			r->decompressor=h.compression;
-			r->posComp=p;
-			r->posStart=p;
-			r->posDecomp=0;
-			if (h.compression==COMPRESS_NONE) {
-				r->decompData=NULL;
-#ifdef ESPFS_HEATSHRINK
-			} else if (h.compression==COMPRESS_HEATSHRINK) {
-				//File is compressed with Heatshrink.
-				char parm;
-				heatshrink_decoder *dec;
-				//Decoder params are stored in 1st byte.
-				readFlashUnaligned(&parm, r->posComp, 1);
-				r->posComp++;
-				httpd_printf("Heatshrink compressed file; decode parms = %x\n", parm);
-				dec=heatshrink_decoder_alloc(16, (parm>>4)&0xf, parm&0xf);
-				r->decompData=dec;
-#endif
-			} else {
-				httpd_printf("Invalid compression: %d\n", h.compression);
-				return NULL;
-			}
-			return r;
+			return espFsOpenHeader(hpos, &h, strlen(namebuf)+1);
 		}
 		//We don't need this file. Skip name and file
 		p+=h.nameLen+h.fileLenComp;
-		if ((int)p&3) p+=4-((int)p&3); //align to next 32bit val
+		if (FLASH_ADDR(p)&3) p+=4-(FLASH_ADDR(p)&3); //align to next 32bit val
 	}
 }
 
-//Read len bytes from the given file into buff. Returns the actual amount of bytes read.
+//Read len bytes from the given file into buff. Returns the actual amount of bytes read, or -1 if
+//the file is compressed and there's no decoder free for it (see espFsPrepare).
 int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 	int flen;
 #ifdef ESPFS_HEATSHRINK
 	int fdlen;
 #endif
 	if (fh==NULL) return 0;
+	if (!espFsPrepare(fh)) return -1;
+	if (fh->cache!=NULL) {
+		espFsCacheHit(fh);
+		if (len>fh->cache->len-fh->posDecomp) len=fh->cache->len-fh->posDecomp;
+		memcpy(buff, fh->cache->data+fh->posDecomp, len);
+		fh->posDecomp+=len;
+		return len;
+	}
 		
-	readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
-	//Cache file length.
+	flen=fh->fileLenComp;
 	//Do stuff depending on the way the file is compressed.
 	if (fh->decompressor==COMPRESS_NONE) {
 		int toRead;
@@ -215,11 +868,11 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 //		httpd_printf("Done reading %d bytes, pos=%x\n", len, fh->posComp);
 		return len;
 #ifdef ESPFS_HEATSHRINK
-	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
-		readFlashUnaligned((char*)&fdlen, (char*)&fh->header->fileLenDecomp, 4);
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK || fh->decompressor==COMPRESS_HEATSHRINK_BLOCKS) {
+		fdlen=fh->fileLenDecomp;
 		int decoded=0;
 		size_t elen, rlen;
-		char ebuff[16];
+		uint32_t ebuff[(ESPFS_HEATSHRINK_INPUT_SIZE+3)/4]; //Aligned, so most of it can be read straight in
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
 //		httpd_printf("Alloc %p\n", dec);
 		if (fh->posDecomp == fdlen) {
@@ -231,12 +884,17 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		// posDecomp equals decompressed file length
 
 		while(decoded<len) {
+			//Every block of a file compressed in blocks is decoded from a fresh decoder state.
+			if (fh->posDecomp==fh->blockEndDecomp && fh->posDecomp<fdlen) {
+				if (!espFsStartBlock(fh, fh->posDecomp>>fh->blockShift)) return decoded;
+			}
 			//Feed data into the decompressor
 			//ToDo: Check ret val of heatshrink fns for errors
-			elen=flen-(fh->posComp - fh->posStart);
+			elen=fh->posCompEnd-fh->posComp;
 			if (elen>0) {
-				readFlashUnaligned(ebuff, fh->posComp, 16);
-				heatshrink_decoder_sink(dec, (uint8_t *)ebuff, (elen>16)?16:elen, &rlen);
+				if (elen>ESPFS_HEATSHRINK_INPUT_SIZE) elen=ESPFS_HEATSHRINK_INPUT_SIZE;
+				readFlashUnaligned((char *)ebuff, fh->posComp, elen);
+				heatshrink_decoder_sink(dec, (uint8_t *)ebuff, elen, &rlen);
 				fh->posComp+=rlen;
 			}
 			//Grab decompressed data and put into buff
@@ -248,6 +906,8 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 //			httpd_printf("Elen %d rlen %d d %d pd %ld fdl %d\n",elen,rlen,decoded, fh->posDecomp, fdlen);
 
 			if (elen == 0) {
+				//Done with this block, but not with the file: go on with the next one.
+				if (fh->posDecomp==fh->blockEndDecomp && fh->posDecomp<fdlen) continue;
 				if (fh->posDecomp == fdlen) {
 //					httpd_printf("Decoder finish\n");
 					heatshrink_decoder_finish(dec);
@@ -264,10 +924,15 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
+	if (fh->cache!=NULL) {
+		espFsLock();
+		fh->cache->refs--;
+		espFsUnlock();
+	}
 #ifdef ESPFS_HEATSHRINK
-	if (fh->decompressor==COMPRESS_HEATSHRINK) {
+	if (fh->decompData!=NULL) {
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-		heatshrink_decoder_free(dec);
+		espFsPutDecoder(dec);
 //		httpd_printf("Freed %p\n", dec);
 	}
 #endif
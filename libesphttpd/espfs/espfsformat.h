@@ -18,11 +18,50 @@ with the FLAG_LASTFILE flag set.
 */
 
 
+/*
+If FLAG_HASH is set, the name area (nameLen bytes) doesn't end with the padding of the name but with
+ESPFS_HASH_LEN bytes of content hash (64-bit FNV-1a of the uncompressed file), so the hash sits right
+before the file data. Readers that don't know about this still find the name and the data fine.
+If FLAG_HEADERS is set, the padded name is followed by a block of HTTP response header lines the
+webserver can send as-is: a 16-bit length, the text (each line ending in \r\n), padding to 32 bit.
+It comes before the hash.
+*/
+
+/*
+Version 2 images start with a directory, so a file can be found without going through all the ones
+before it. It's an entry with FLAG_DIRECTORY set and the name "/", which older readers skip as it
+never matches a requested file. Its data is an array of EspFsDirEntry, sorted on hash: the 32-bit
+FNV-1a of the file name and the offset of the file header from the start of the image. Files with
+the same hash are next to each other.
+*/
+
+/*
+If FLAG_LINK is set, the file has the same data as a file earlier in the image and doesn't store it
+again: fileLenComp is 0, and the name area ends (before the hash) with a 32-bit distance from this
+header back to the header of the file that has the data. The compression and lengths of the data are
+those in that header. The name, flags and header block are still the file's own.
+*/
+
+/*
+COMPRESS_HEATSHRINK_BLOCKS files are cut in blocks that are compressed with heatshrink one by one, so
+decoding can start at the beginning of any block instead of only at the start of the file. The data
+starts with an EspFsBlockHeader, followed by blockCount 32-bit offsets of the compressed blocks from
+the start of the data; the compressed blocks follow those. Every block but the last decompresses to
+(1<<blockShift) bytes.
+*/
+
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+#define FLAG_HASH (1<<2)
+#define FLAG_HEADERS (1<<3)
+#define FLAG_DIRECTORY (1<<4)
+#define FLAG_LINK (1<<5)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
+#define COMPRESS_HEATSHRINK_BLOCKS 2
 #define ESPFS_MAGIC 0x73665345
+#define ESPFS_HASH_LEN 8
+#define ESPFS_DIRECTORY_NAME "/"
 
 typedef struct {
 	int32_t magic;
@@ -33,6 +72,17 @@ typedef struct {
 	int32_t fileLenDecomp;
 } __attribute__((packed)) EspFsHeader;
 
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;
+} EspFsDirEntry;
+
+typedef struct {
+	uint8_t parm;			//Heatshrink window<<4 | lookahead, the same for all blocks
+	uint8_t blockShift;
+	uint16_t blockCount;
+} EspFsBlockHeader;
+
 #endif
 #ifdef __cplusplus
 }
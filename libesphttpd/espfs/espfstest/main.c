@@ -10,12 +10,52 @@ the decompressors: code compiled natively is way easier to debug using gdb et al
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 
 
 #include "espfs.h"
+#include "espfsformat.h"
 
 char *espFsData;
 
+#define TIMING_ROUNDS 1000
+
+static double nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+//Time opening every file in the image, plus one that isn't there, TIMING_ROUNDS times each.
+static void timeOpens(char *image, const char *how) {
+	EspFsHeader *h;
+	char *p=image;
+	char *name;
+	double start, total=0;
+	int i, files=0;
+	EspFsFile *ef;
+
+	while (1) {
+		h=(EspFsHeader *)p;
+		if (h->magic!=ESPFS_MAGIC || (h->flags&FLAG_LASTFILE)) break;
+		name=p+sizeof(EspFsHeader);
+		if (!(h->flags&FLAG_DIRECTORY)) {
+			start=nowUs();
+			for (i=0; i<TIMING_ROUNDS; i++) espFsClose(espFsOpen(name));
+			total+=nowUs()-start;
+			files++;
+		}
+		p+=sizeof(EspFsHeader)+h->nameLen+h->fileLenComp;
+		p+=(4-((p-image)&3))&3;
+	}
+	printf("%s: %d files, average open %.3f us\n", how,
+			files, files?total/(files*TIMING_ROUNDS):0);
+	start=nowUs();
+	for (i=0; i<TIMING_ROUNDS; i++) ef=espFsOpen("does/not/exist");
+	printf("missing file: %.3f us%s\n", (nowUs()-start)/TIMING_ROUNDS, ef?" (found?!)":"");
+}
+
 int main(int argc, char **argv) {
 	int f, out;
 	int len;
@@ -26,8 +66,13 @@ int main(int argc, char **argv) {
 
 	if (argc!=3) {
 		printf("Usage: %s espfs-image file\nExpands file from the espfs-image archive.\n", argv[0]);
+		printf("Or: %s -t espfs-image\nTimes how long opening the files in the espfs-image takes.\n", argv[0]);
 		exit(0);
 	}
+	if (strcmp(argv[1], "-t")==0) {
+		argv[1]=argv[2];
+		argv[2]=NULL;
+	}
 
 	f=open(argv[1], O_RDONLY);
 	if (f<=0) {
@@ -47,6 +92,13 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (argv[2]==NULL) {
+		timeOpens(espFsData, (espFsData[4]&FLAG_DIRECTORY)?"directory":"linear");
+		printf("RAM index of %d bytes\n", espFsBuildIndex(1<<20));
+		timeOpens(espFsData, "RAM index");
+		exit(0);
+	}
+
 	ef=espFsOpen(argv[2]);
 	if (ef==NULL) {
 		printf("Couldn't find %s in image.\n", argv[2]);
@@ -59,7 +111,7 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 	
-	while ((len=espFsRead(ef, buff, 128))!=0) {
+	while ((len=espFsRead(ef, buff, 128))>0) {
 		write(out, buff, len);
 	}
 	espFsClose(ef);
@@ -6,11 +6,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #ifdef __MINGW32__
 #include <io.h>
 #endif
 #include "espfs.h"
 #include "espfsformat.h"
+#include "httpd-mime.h"
 
 //Heatshrink
 #ifdef ESPFS_HEATSHRINK
@@ -49,27 +51,25 @@ int htoxl(int in) {
 }
 
 #ifdef ESPFS_HEATSHRINK
-size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int level) {
+//Window and lookahead sizes for the compression levels 1-9, as (level-1)/2.
+int ws[]={5, 6, 8, 11, 13};
+int ls[]={3, 3, 4, 4, 4};
+
+//Compress in with heatshrink into out. Returns the length of the compressed data.
+size_t encodeHeatshrink(char *in, int insize, char *out, int outsize, int window, int lookahead) {
 	char *inp=in;
 	char *outp=out;
 	size_t len;
-	int ws[]={5, 6, 8, 11, 13};
-	int ls[]={3, 3, 4, 4, 4};
 	HSE_poll_res pres;
 	HSE_sink_res sres;
 	size_t r;
-	if (level==-1) level=8;
-	level=(level-1)/2; //level is now 0, 1, 2, 3, 4
-	heatshrink_encoder *enc=heatshrink_encoder_alloc(ws[level], ls[level]);
+	heatshrink_encoder *enc=heatshrink_encoder_alloc(window, lookahead);
 	if (enc==NULL) {
 		perror("allocating mem for heatshrink");
 		exit(1);
 	}
-	//Save encoder parms as first byte
-	*outp=(ws[level]<<4)|ls[level];
-	outp++; outsize--;
 
-	r=1;
+	r=0;
 	do {
 		if (insize>0) {
 			sres=heatshrink_encoder_sink(enc, inp, insize, &len);
@@ -93,6 +93,40 @@ size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int leve
 	heatshrink_encoder_free(enc);
 	return r;
 }
+
+size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int window, int lookahead) {
+	//Save encoder parms as first byte
+	*out=(window<<4)|lookahead;
+	return 1+encodeHeatshrink(in, insize, out+1, outsize-1, window, lookahead);
+}
+
+//Block size for COMPRESS_HEATSHRINK_BLOCKS, as log2. Set with -b.
+int blockShift=12;
+
+//Compress in with heatshrink in blocks of (1<<blockShift) bytes that can each be decoded on their
+//own, behind a header and a table with the offset of every block (see espfsformat.h).
+size_t compressHeatshrinkBlocks(char *in, int insize, char *out, int outsize, int window, int lookahead) {
+	EspFsBlockHeader *bh=(EspFsBlockHeader *)out;
+	int32_t *table=(int32_t *)(out+sizeof(EspFsBlockHeader));
+	int blockSize=1<<blockShift;
+	int count=(insize+blockSize-1)/blockSize;
+	int i, len;
+	size_t r;
+	if (count>0xffff) {
+		fprintf(stderr, "File has more than 65535 blocks; use a larger block size.\n");
+		exit(1);
+	}
+	bh->parm=(window<<4)|lookahead;
+	bh->blockShift=blockShift;
+	bh->blockCount=htoxs(count);
+	r=sizeof(EspFsBlockHeader)+count*4;
+	for (i=0; i<count; i++) {
+		len=(insize-i*blockSize<blockSize)?insize-i*blockSize:blockSize;
+		table[i]=htoxl(r);
+		r+=encodeHeatshrink(in+i*blockSize, len, out+r, outsize-r, window, lookahead);
+	}
+	return r;
+}
 #endif
 
 #ifdef ESPFS_GZIP
@@ -180,48 +214,261 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName) {
-	char *fdat, *cdat;
+//Unless -n is given, the image starts with a directory of all files (see espfsformat.h). Its size
+//isn't known until all files are in, so the rest of the image is kept in memory until then.
+int writeDirectory=1;
+char *outBuf=NULL;
+//Image bytes output so far, including what went to stdout directly; also the position of the next file.
+size_t outLen=0, outCap=0;
+
+EspFsDirEntry *dirEntries=NULL;
+int dirCount=0;
+
+//Output image data: to stdout directly, or into the buffer if a directory will go in front of it.
+void emit(const void *data, size_t len) {
+	if (!writeDirectory) {
+		write(1, data, len);
+		outLen+=len;
+		return;
+	}
+	if (outLen+len>outCap) {
+		outCap=(outLen+len)*2;
+		outBuf=realloc(outBuf, outCap);
+		if (outBuf==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(outBuf+outLen, data, len);
+	outLen+=len;
+}
+
+//32-bit FNV-1a of a file name, as used for the directory.
+uint32_t nameHash(const char *name) {
+	uint32_t h=2166136261U;
+	while (*name) h=(h^(uint8_t)*name++)*16777619U;
+	return h;
+}
+
+int compareDirEntries(const void *a, const void *b) {
+	const EspFsDirEntry *ea=a, *eb=b;
+	if (ea->hash!=eb->hash) return (ea->hash<eb->hash)?-1:1;
+	return (ea->offset<eb->offset)?-1:1;
+}
+
+//Set by -p: store a ready-made block of response headers with every file.
+int prebuiltHeaders=0;
+
+//The same table the webserver uses, so prebuilt headers match what it would send itself.
+static const MimeMap mimeTypes[]={
+	HTTPD_MIME_TYPES
+};
+
+const char *getMimetype(char *name) {
+	int i=0;
+	char *ext=strrchr(name, '.');
+	ext=(ext==NULL)?name:ext+1;
+	while (mimeTypes[i].ext!=NULL && strcmp(ext, mimeTypes[i].ext)!=0) i++;
+	return mimeTypes[i].mimetype;
+}
+
+//Build the header lines cgiEspFsHook would send for this file, minus the empty line that ends them.
+int buildHeaders(char *buff, int buffLen, char *name, int flags, int compression, int len, uint8_t *hash) {
+	int l, i;
+	l=snprintf(buff, buffLen, "Content-Type: %s\r\n", getMimetype(name));
+	if (flags&FLAG_GZIP) l+=snprintf(buff+l, buffLen-l, "Content-Encoding: gzip\r\n");
+	l+=snprintf(buff+l, buffLen-l, "Content-Length: %d\r\nETag: \"", len);
+	for (i=0; i<ESPFS_HASH_LEN; i++) l+=snprintf(buff+l, buffLen-l, "%02x", hash[i]);
+	l+=snprintf(buff+l, buffLen-l, "\"\r\n");
+	//The webserver can only serve ranges of files it can seek in.
+	if (compression==COMPRESS_NONE || compression==COMPRESS_HEATSHRINK_BLOCKS) l+=snprintf(buff+l, buffLen-l, "Accept-Ranges: bytes\r\n");
+	l+=snprintf(buff+l, buffLen-l, "Cache-Control: max-age=3600, must-revalidate\r\n");
+	return l;
+}
+
+//64-bit FNV-1a of the file contents, stored in the image so the webserver can use it as an ETag.
+//Written byte by byte, least significant first, so the image is the same on every host.
+void contentHash(char *data, off_t len, uint8_t *hash) {
+	uint64_t h=0xcbf29ce484222325ULL;
+	off_t i;
+	for (i=0; i<len; i++) {
+		h^=(uint8_t)data[i];
+		h*=0x100000001b3ULL;
+	}
+	for (i=0; i<ESPFS_HASH_LEN; i++) {
+		hash[i]=h;
+		h>>=8;
+	}
+}
+
+//Set by -a: instead of the window and lookahead of the compression level, try every window that fits
+//the decoder RAM budget set with -r with a few lookaheads each, and keep the smallest result. Files
+//that get gzipped also get a go with heatshrink then; whichever is smaller is kept. The default budget
+//matches the decoders espfs.c uses by default (ESPFS_HEATSHRINK_WINDOW_BITS).
+int autoTune=0;
+int decoderRam=2048;
+
+//Compress in with heatshrink as compression (whole or in blocks) into a buffer it allocates. Returns
+//the length of the result.
+off_t compressHs(int compression, char *in, off_t size, int level, char **out) {
+#ifdef ESPFS_HEATSHRINK
+	char *tmp, *swap;
+	off_t bufSize, len, best=-1;
+	int w, l;
+	if (compression==COMPRESS_HEATSHRINK || compression==COMPRESS_HEATSHRINK_BLOCKS) {
+		//Room for the worst case, plus the header and offset table of the block format.
+		bufSize=size*2+sizeof(EspFsBlockHeader)+((size>>blockShift)+1)*4;
+		*out=malloc(bufSize);
+		if (!autoTune) {
+			if (level==-1) level=8;
+			level=(level-1)/2; //level is now 0, 1, 2, 3, 4
+			if (compression==COMPRESS_HEATSHRINK) return compressHeatshrink(in, size, *out, bufSize, ws[level], ls[level]);
+			return compressHeatshrinkBlocks(in, size, *out, bufSize, ws[level], ls[level]);
+		}
+		tmp=malloc(bufSize);
+		for (w=HEATSHRINK_MIN_WINDOW_BITS; w<=HEATSHRINK_MAX_WINDOW_BITS && (1<<w)<=decoderRam; w++) {
+			for (l=HEATSHRINK_MIN_LOOKAHEAD_BITS; l<w && l<=8; l++) {
+				if (compression==COMPRESS_HEATSHRINK) {
+					len=compressHeatshrink(in, size, tmp, bufSize, w, l);
+				} else {
+					len=compressHeatshrinkBlocks(in, size, tmp, bufSize, w, l);
+				}
+				//Strictly smaller only, so the first of equal results wins and the output is repeatable.
+				if (best<0 || len<best) {
+					best=len;
+					swap=*out;
+					*out=tmp;
+					tmp=swap;
+				}
+			}
+		}
+		free(tmp);
+		if (best<0) {
+			fprintf(stderr, "No heatshrink window fits a decoder RAM budget of %d bytes.\n", decoderRam);
+			exit(1);
+		}
+		return best;
+	}
+#endif
+	fprintf(stderr, "Unknown compression - %d\n", compression);
+	exit(1);
+}
+
+//A file that goes into the image. Compressing is done on worker threads; writing the result to the
+//image happens on the main thread, in the order the files were given.
+typedef struct FileJob {
+	char *path;			//Path to read the file from
+	char *name;			//Name in the image
+	int compression;
+	int8_t flags;
+	char *cdat;
 	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
-	int8_t flags = 0;
+	uint8_t hash[ESPFS_HASH_LEN];
+	int ok;
+	size_t offset;		//Position of its header in the image, once written
+	struct FileJob *linkTo;	//File with the same data that this file links to, or NULL
+} FileJob;
+
+//Set by -d: store files with the same data as an earlier one in full, instead of as a link to it.
+int storeDuplicates=0;
+
+//Find an earlier file that was stored with exactly the same data as job, so job can link to it.
+FileJob *findDuplicate(FileJob *jobs, int count, FileJob *job) {
+	int i;
+	for (i=0; i<count; i++) {
+		if (!jobs[i].ok || jobs[i].linkTo!=NULL) continue;
+		if (jobs[i].compression!=job->compression || jobs[i].flags!=job->flags) continue;
+		if (jobs[i].size!=job->size || jobs[i].csize!=job->csize) continue;
+		if (memcmp(jobs[i].hash, job->hash, ESPFS_HASH_LEN)!=0) continue;
+		if (memcmp(jobs[i].cdat, job->cdat, job->csize)==0) return &jobs[i];
+	}
+	return NULL;
+}
+
+void compressFile(FileJob *job, int compression, int level) {
+	char *fdat;
+	off_t size;
+	int f;
+	job->ok=0;
+	f=open(job->path, O_RDONLY|O_BINARY);
+	if (f<0) {
+		perror(job->path);
+		return;
+	}
 	size=lseek(f, 0, SEEK_END);
 	fdat=malloc(size);
 	lseek(f, 0, SEEK_SET);
 	read(f, fdat, size);
-	
+	close(f);
 
+	job->flags=0;
+	job->compression=compression;
 #ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
-		csize = size*3;
-		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
-			csize = 100; // enlarge buffer if this is the case
-		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
-		compression = COMPRESS_NONE;
-		flags = FLAG_GZIP;
+	if (shouldCompressGzip(job->name)) {
+		job->csize = size*3;
+		if (job->csize<100) // gzip has some headers that do not fit when trying to compress small files
+			job->csize = 100; // enlarge buffer if this is the case
+		job->cdat=malloc(job->csize);
+		job->csize=compressGzip(fdat, size, job->cdat, job->csize, level);
+		job->compression = COMPRESS_NONE;
+		job->flags = FLAG_GZIP;
+		if (autoTune && compression!=COMPRESS_NONE) {
+			char *hdat;
+			off_t hsize;
+			hsize=compressHs(compression, fdat, size, level, &hdat);
+			if (hsize<job->csize) {
+				free(job->cdat);
+				job->cdat=hdat;
+				job->csize=hsize;
+				job->compression=compression;
+				job->flags=0;
+			} else {
+				free(hdat);
+			}
+		}
 	} else
 #endif
 	if (compression==COMPRESS_NONE) {
-		csize=size;
-		cdat=fdat;
-#ifdef ESPFS_HEATSHRINK
-	} else if (compression==COMPRESS_HEATSHRINK) {
-		cdat=malloc(size*2);
-		csize=compressHeatshrink(fdat, size, cdat, size*2, level);
-#endif
+		job->csize=size;
+		job->cdat=fdat;
 	} else {
-		fprintf(stderr, "Unknown compression - %d\n", compression);
-		exit(1);
+		job->csize=compressHs(compression, fdat, size, level, &job->cdat);
 	}
 
-	if (csize>size) {
+	if (job->csize>size) {
 		//Compressing enbiggened this file. Revert to uncompressed store.
-		compression=COMPRESS_NONE;
-		csize=size;
-		cdat=fdat;
-		flags=0;
+		free(job->cdat);
+		job->compression=COMPRESS_NONE;
+		job->csize=size;
+		job->cdat=fdat;
+		job->flags=0;
+	}
+	contentHash(fdat, size, job->hash);
+	if (job->cdat!=fdat) free(fdat);
+	job->size=size;
+	job->ok=1;
+}
+
+//Write a compressed file to the image. Returns the compression ratio in percent.
+int emitFile(FileJob *job, char **compName) {
+	EspFsHeader h;
+	char *name=job->name;
+	off_t size=job->size, csize=job->csize;
+	int compression=job->compression;
+	int nameLen;
+	int8_t flags=job->flags;
+	char hdrs[512];
+	int hdrsLen=0, hdrsPad;
+	short hdrsLenX;
+	FileJob *target=job->linkTo;
+	int32_t back;
+
+	flags|=FLAG_HASH;
+	if (target!=NULL) flags|=FLAG_LINK;
+	if (prebuiltHeaders) {
+		//Content-Length is what the webserver sends: the gzipped data as-is, the rest decompressed.
+		hdrsLen=buildHeaders(hdrs, sizeof(hdrs), name, flags, compression, (compression==COMPRESS_NONE)?csize:size, job->hash);
+		flags|=FLAG_HEADERS;
 	}
 
 	//Fill header data
@@ -230,27 +477,58 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 	h.compression=compression;
 	h.nameLen=nameLen=strlen(name)+1;
 	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
+	if (flags&FLAG_HEADERS) {
+		//Header block goes after the padded name: 16-bit length, text, padding to 32 bit.
+		hdrsPad=(2+hdrsLen+3)&~3;
+		h.nameLen+=hdrsPad;
+	}
+	if (flags&FLAG_LINK) {
+		//Distance back to the file with the data goes before the hash; there's no data here.
+		h.nameLen+=4;
+		csize=0;
+	}
+	h.nameLen+=ESPFS_HASH_LEN; //Hash goes last, right before the data
 	h.nameLen=htoxs(h.nameLen);
 	h.fileLenComp=htoxl(csize);
 	h.fileLenDecomp=htoxl(size);
+	job->offset=outLen;
 	
-	write(1, &h, sizeof(EspFsHeader));
-	write(1, name, nameLen);
+	if (writeDirectory) {
+		//Offset is fixed up for the size of the directory when that's known.
+		dirEntries=realloc(dirEntries, (dirCount+1)*sizeof(EspFsDirEntry));
+		dirEntries[dirCount].hash=nameHash(name);
+		dirEntries[dirCount].offset=outLen;
+		dirCount++;
+	}
+	emit(&h, sizeof(EspFsHeader));
+	emit(name, nameLen);
 	while (nameLen&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		nameLen++;
 	}
-	write(1, cdat, csize);
+	if (flags&FLAG_HEADERS) {
+		hdrsLenX=htoxs(hdrsLen);
+		emit(&hdrsLenX, 2);
+		emit(hdrs, hdrsLen);
+		for (hdrsPad-=2+hdrsLen; hdrsPad>0; hdrsPad--) emit("\000", 1);
+	}
+	if (flags&FLAG_LINK) {
+		back=htoxl(job->offset-target->offset);
+		emit(&back, 4);
+	}
+	emit(job->hash, ESPFS_HASH_LEN);
+	emit(job->cdat, csize);
 	//Pad out to 32bit boundary
 	while (csize&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		csize++;
 	}
-	free(fdat);
 
 	if (compName != NULL) {
 		if (h.compression==COMPRESS_HEATSHRINK) {
 			*compName = "heatshrink";
+		} else if (h.compression==COMPRESS_HEATSHRINK_BLOCKS) {
+			*compName = "heatshrink blocks";
 		} else if (h.compression==COMPRESS_NONE) {
 			if (h.flags & FLAG_GZIP) {
 				*compName = "gzip";
@@ -264,6 +542,23 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 	return size ? (csize*100)/size : 100;
 }
 
+//Files are compressed by -j threads (by default one per CPU), each taking the next file in the list.
+FileJob *jobs=NULL;
+int jobCount=0, nextJob=0;
+int compType, compLvl=-1;
+pthread_mutex_t jobMux=PTHREAD_MUTEX_INITIALIZER;
+
+void *compressWorker(void *arg) {
+	int i;
+	while (1) {
+		pthread_mutex_lock(&jobMux);
+		i=nextJob++;
+		pthread_mutex_unlock(&jobMux);
+		if (i>=jobCount) return NULL;
+		compressFile(&jobs[i], compType, compLvl);
+	}
+}
+
 //Write final dummy header with FLAG_LASTFILE set.
 void finishArchive() {
 	EspFsHeader h;
@@ -273,25 +568,51 @@ void finishArchive() {
 	h.nameLen=htoxs(0);
 	h.fileLenComp=htoxl(0);
 	h.fileLenDecomp=htoxl(0);
+	emit(&h, sizeof(EspFsHeader));
+}
+
+//Write the directory entry, sorted on name hash, followed by the files that were kept in memory.
+void writeImage() {
+	EspFsHeader h;
+	int i, dirLen=dirCount*sizeof(EspFsDirEntry);
+	int base=sizeof(EspFsHeader)+4+dirLen;
+	qsort(dirEntries, dirCount, sizeof(EspFsDirEntry), compareDirEntries);
+	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
+	h.flags=FLAG_DIRECTORY;
+	h.compression=COMPRESS_NONE;
+	h.nameLen=htoxs(4);
+	h.fileLenComp=htoxl(dirLen);
+	h.fileLenDecomp=htoxl(dirLen);
 	write(1, &h, sizeof(EspFsHeader));
+	write(1, ESPFS_DIRECTORY_NAME"\000\000\000", 4);
+	for (i=0; i<dirCount; i++) {
+		dirEntries[i].hash=htoxl(dirEntries[i].hash);
+		dirEntries[i].offset=htoxl(dirEntries[i].offset+base);
+	}
+	write(1, dirEntries, dirLen);
+	write(1, outBuf, outLen);
 }
 
 int main(int argc, char **argv) {
-	int f, x;
+	int x, n;
 	char fileName[1024];
 	char *realName;
 	struct stat statBuf;
 	int serr;
 	int rate;
 	int err=0;
-	int compType;  //default compression type - heatshrink
-	int compLvl=-1;
+	int threadCt=1;
+	pthread_t *threads;
+#ifdef _SC_NPROCESSORS_ONLN
+	threadCt=sysconf(_SC_NPROCESSORS_ONLN);
+	if (threadCt<1) threadCt=1;
+#endif
 
 #ifdef __MINGW32__
 	setmode(fileno(stdout), O_BINARY);
 #endif
 #ifdef ESPFS_HEATSHRINK
-	compType = COMPRESS_HEATSHRINK;
+	compType = COMPRESS_HEATSHRINK; //default compression type
 #else
 	compType = COMPRESS_NONE;
 #endif
@@ -304,6 +625,33 @@ int main(int argc, char **argv) {
 			compLvl=atoi(argv[x+1]);
 			if (compLvl<1 || compLvl>9) err=1;
 			x++;
+#ifdef ESPFS_HEATSHRINK
+		} else if (strcmp(argv[x], "-b")==0 && x+1<argc) {
+			//Block size must be a power of two from 256 to 65536; store its log2.
+			n=atoi(argv[x+1]);
+			if (n<256 || n>65536 || (n&(n-1))!=0) {
+				err=1;
+			} else {
+				for (blockShift=8; (1<<blockShift)!=n; blockShift++) ;
+			}
+			x++;
+		} else if (strcmp(argv[x], "-a")==0) {
+			autoTune=1;
+		} else if (strcmp(argv[x], "-r")==0 && x+1<argc) {
+			decoderRam=atoi(argv[x+1]);
+			if (decoderRam<1) err=1;
+			x++;
+#endif
+		} else if (strcmp(argv[x], "-j")==0 && x+1<argc) {
+			threadCt=atoi(argv[x+1]);
+			if (threadCt<1) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-p")==0) {
+			prebuiltHeaders=1;
+		} else if (strcmp(argv[x], "-n")==0) {
+			writeDirectory=0;
+		} else if (strcmp(argv[x], "-d")==0) {
+			storeDuplicates=1;
 #ifdef ESPFS_GZIP
 		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
 			if (!parseGzipExtensions(argv[x+1])) err=1;
@@ -322,18 +670,26 @@ int main(int argc, char **argv) {
 
 	if (err) {
 		fprintf(stderr, "%s - Program to create espfs images\n", argv[0]);
-		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] ", argv[0]);
+		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] [-a] [-r decoder_ram] [-b block_size] \n[-j threads] [-p] [-n] [-d] ", argv[0]);
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "[-g gzipped_extensions] ");
 #endif
 		fprintf(stderr, "> out.espfs\n");
 		fprintf(stderr, "Compressors:\n");
 #ifdef ESPFS_HEATSHRINK
-		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n");
+		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n2 - Heatshrink in blocks, so the webserver can seek in the file\n");
 #else
 		fprintf(stderr, "0 - None(default)\n");
 #endif
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
+#ifdef ESPFS_HEATSHRINK
+		fprintf(stderr, "\n-a: pick the heatshrink window and lookahead per file: try all windows that fit in \nthe decoder RAM given with -r (default 2048 bytes) and keep what compresses best. \nFiles that are gzipped get compressed with heatshrink too; the smaller one is kept.\n");
+		fprintf(stderr, "\n-b: uncompressed size of the blocks compressor 2 uses; a power of two from 256 to \n65536. Defaults to 4096. Smaller blocks seek faster but compress worse.\n");
+#endif
+		fprintf(stderr, "\n-j: amount of threads that compress files. Defaults to the amount of CPUs.\n");
+		fprintf(stderr, "\n-n: don't start the image with a directory of the files. Opening a file is slower \nthen, as the webserver has to go through all files to find it.\n");
+		fprintf(stderr, "\n-d: store files with the same contents as an earlier file in full. By default, \nthey only get a header that refers to the data of the earlier file.\n");
+		fprintf(stderr, "\n-p: store prebuilt HTTP response headers with every file, so the webserver \ndoesn't have to put them together at runtime. Costs about 120 bytes per file.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
 #endif
@@ -350,22 +706,37 @@ int main(int argc, char **argv) {
 			realName=fileName;
 			if (fileName[0]=='.') realName++;
 			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY|O_BINARY);
-			if (f>0) {
-				char *compName = "unknown";
-				rate=handleFile(f, realName, compType, compLvl, &compName);
-				fprintf(stderr, "%s (%d%%, %s)\n", realName, rate, compName);
-				close(f);
-			} else {
-				perror(fileName);
-			}
+			jobs=realloc(jobs, (jobCount+1)*sizeof(FileJob));
+			jobs[jobCount].path=strdup(fileName);
+			jobs[jobCount].name=jobs[jobCount].path+(realName-fileName);
+			jobCount++;
 		} else {
 			if (serr!=0) {
 				perror(fileName);
 			}
 		}
 	}
+
+	if (threadCt>jobCount) threadCt=jobCount;
+	threads=malloc(threadCt*sizeof(pthread_t));
+	for (x=1; x<threadCt; x++) pthread_create(&threads[x], NULL, compressWorker, NULL);
+	compressWorker(NULL);
+	for (x=1; x<threadCt; x++) pthread_join(threads[x], NULL);
+
+	//Written in the order the files were given, so the image doesn't depend on the amount of threads.
+	for (x=0; x<jobCount; x++) {
+		if (!jobs[x].ok) continue;
+		char *compName = "unknown";
+		jobs[x].linkTo=storeDuplicates?NULL:findDuplicate(jobs, x, &jobs[x]);
+		rate=emitFile(&jobs[x], &compName);
+		if (jobs[x].linkTo!=NULL) {
+			fprintf(stderr, "%s (same as %s, stored as a link)\n", jobs[x].name, jobs[x].linkTo->name);
+		} else {
+			fprintf(stderr, "%s (%d%%, %s)\n", jobs[x].name, rate, compName);
+		}
+	}
 	finishArchive();
+	if (writeDirectory) writeImage();
 	return 0;
 }
 
@@ -11,7 +11,24 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef FREERTOS
+#ifdef HTTPD_POSIX
+//Native build on a PC, used to benchmark and debug the httpd without hardware.
+#include <stdint.h>
+#include <strings.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define os_printf printf
+
+#elif defined(FREERTOS)
 #include <stdint.h>
 
 #ifdef ESP32
@@ -35,7 +52,9 @@ extern "C" {
 #endif
 
 #include "platform.h"
+#ifndef HTTPD_POSIX
 #include "espmissingincludes.h"
+#endif
 
 
 #ifdef __cplusplus
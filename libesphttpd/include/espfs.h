@@ -16,10 +16,29 @@ typedef enum {
 
 typedef struct EspFsFile EspFsFile;
 
+//Counters of the file cache espFsCacheInit sets up.
+typedef struct {
+	unsigned int hits;		// Files that were served from the cache, counted once per open
+	unsigned int misses;	// Files that weren't in the cache when they were first read, including ones too large for it
+	unsigned int evictions;	// Files dropped from the cache to make room for others
+	unsigned int bytes;		// Bytes of file contents in the cache now
+	unsigned int files;		// Files in the cache now
+} EspFsCacheStats;
+
 EspFsInitResult espFsInit(void *flashAddress);
+int espFsBuildIndex(int maxBytes);
+void espFsCacheInit(int maxBytes, int maxFileBytes);
+const EspFsCacheStats *espFsGetCacheStats();
 EspFsFile *espFsOpen(char *fileName);
+int espFsPrepare(EspFsFile *fh);
 int espFsFlags(EspFsFile *fh);
+int espFsFileSize(EspFsFile *fh);
+int espFsHash(EspFsFile *fh, char *hash);
+int espFsHeaders(EspFsFile *fh, char *buff, int len);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+const char *espFsDirect(EspFsFile *fh, int *len);
+int espFsSkip(EspFsFile *fh, int len);
+int espFsSeek(EspFsFile *fh, int pos);
 void espFsClose(EspFsFile *fh);
 
 
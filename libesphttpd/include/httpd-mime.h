@@ -0,0 +1,33 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef HTTPD_MIME_H
+#define HTTPD_MIME_H
+
+//Struct to keep extension->mime data in
+typedef struct {
+	const char *ext;
+	const char *mimetype;
+} MimeMap;
+
+//The mappings from file extensions to mime types, as initializer of a MimeMap array. Both the
+//webserver and mkespfsimage (for the headers it prebuilds) use these. If you need an extra mime
+//type, add it here.
+#define HTTPD_MIME_TYPES \
+	{"htm", "text/htm"}, \
+	{"html", "text/html"}, \
+	{"css", "text/css"}, \
+	{"js", "text/javascript"}, \
+	{"txt", "text/plain"}, \
+	{"jpg", "image/jpeg"}, \
+	{"jpeg", "image/jpeg"}, \
+	{"png", "image/png"}, \
+	{"svg", "image/svg+xml"}, \
+	{"xml", "text/xml"}, \
+	{"json", "application/json"}, \
+	{NULL, "text/html"}, /* default value */
+
+#endif
+#ifdef __cplusplus
+}
+#endif
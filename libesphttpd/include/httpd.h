@@ -8,14 +8,29 @@ extern "C" {
 
 //Max length of request head. This is statically allocated for each connection.
 #define HTTPD_MAX_HEAD_LEN		1024
-//Max post buffer len. This is dynamically malloc'ed if needed.
+//Max amount of request headers that can be looked up with httpdGetHeader. Headers after this are
+//ignored.
+#define HTTPD_MAX_HEADERS		24
+//Max post buffer len. Requests with a body take one of HTTPD_SHARED_BUFFERS buffers of this size
+//(plus one) while their cgi runs; if none is free, they're answered with a 503.
 #define HTTPD_MAX_POST_LEN		2048
-//Max send buffer len. This is allocated on the stack.
+//Max send buffer len. This is allocated for each connection slot at httpdInit.
 #define HTTPD_MAX_SENDBUFF_LEN	2048
 //If some data can't be sent because the underlaying socket doesn't accept the data (like the nonos
-//layer is prone to do), we put it in a backlog that is dynamically malloc'ed. This defines the max
-//size of the backlog.
+//layer is prone to do), we put it in a backlog. This is a ring buffer of this size, taken from
+//HTTPD_SHARED_BUFFERS ones until it's sent. If none is free, the data waits in the send buffer and
+//the cgi isn't called until it's gone. If data doesn't fit anymore, the connection is closed.
 #define HTTPD_MAX_BACKLOG_SIZE	(4*1024)
+//Requests a client pipelines while the cgi for an earlier request is still busy are queued in a
+//buffer of this size, taken from HTTPD_SHARED_BUFFERS ones. If the client sends more than this or
+//none is free, the connection is closed after the current response.
+#define HTTPD_MAX_PIPELINE_LEN	1024
+//The POST, backlog and pipeline buffers are only needed by some connections some of the time, so
+//instead of one per connection slot there are this many of each, shared by all connections. They
+//are allocated the first time they're needed and kept for re-use after that.
+#ifndef HTTPD_SHARED_BUFFERS
+#define HTTPD_SHARED_BUFFERS	((HTTPD_MAX_CONNECTIONS+1)/2)
+#endif
 
 #define HTTPD_CGI_MORE 0
 #define HTTPD_CGI_DONE 1
@@ -53,6 +68,7 @@ struct HttpdConnData {
 	int remote_port;		// Remote TCP port
 	uint8 remote_ip[4];		// IP address of client
 	uint8 slot;				// Slot ID
+	unsigned int gen;		// Changes when the slot is done with this connection; see httpdConnSendStart
 };
 
 //A struct describing the POST data sent inside the http connection.  This is used by the CGI functions
@@ -65,6 +81,15 @@ struct HttpdPostData {
 	char *multipartBoundary; //Text of the multipart boundary, if any
 };
 
+//Counters the httpd keeps, mostly useful for diagnostics and tuning.
+typedef struct {
+	unsigned int requests;		// Amount of requests handed to a CGI function
+	unsigned int heapAllocs;	// Heap allocations done by the httpd core after httpdInit
+	unsigned int backlogDrops;	// Times data was dropped because the send backlog was full; the
+								// connection is closed when that happens
+	unsigned int lockWaits;		// Times a connection lock was busy and had to be waited for
+} HttpdStats;
+
 //A struct describing an url. This is the main struct that's used to send different URL requests to
 //different routines.
 typedef struct {
@@ -79,18 +104,25 @@ int cgiRedirectApClientToHostname(HttpdConnData *connData);
 void httpdRedirect(HttpdConnData *conn, char *newUrl);
 int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
 int httpdFindArg(char *line, char *arg, char *buff, int buffLen);
-void httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
+int httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
 const char *httpdGetMimetype(char *url);
 void httdSetTransferMode(HttpdConnData *conn, int mode);
+void httpdSetContentLength(HttpdConnData *conn, int len);
 void httpdStartResponse(HttpdConnData *conn, int code);
+void httpdStartResponseHeaders(HttpdConnData *conn, int code, const char *block, int len);
 void httpdHeader(HttpdConnData *conn, const char *field, const char *val);
 void httpdEndHeaders(HttpdConnData *conn);
 int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
+const char *httpdGetHeaderPtr(HttpdConnData *conn, const char *header, int *len);
 int httpdSend(HttpdConnData *conn, const char *data, int len);
+int httpdSendDirect(HttpdConnData *conn, const char *data, int len);
+char *httpdSendReserve(HttpdConnData *conn, int *len);
+void httpdSendCommit(HttpdConnData *conn, int len);
 void httpdFlushSendBuffer(HttpdConnData *conn);
 void httpdContinue(HttpdConnData *conn);
-void httpdConnSendStart(HttpdConnData *conn);
+int httpdConnSendStart(HttpdConnData *conn, unsigned int gen);
 void httpdConnSendFinish(HttpdConnData *conn);
+const HttpdStats *httpdGetStats();
 
 //Platform dependent code should call these.
 void httpdSentCb(ConnTypePtr conn, char *remIp, int remPort);
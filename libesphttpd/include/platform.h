@@ -4,7 +4,17 @@ extern "C" {
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
-#ifdef FREERTOS
+#ifdef HTTPD_POSIX
+typedef struct PosixConnType PosixConnType;
+typedef PosixConnType* ConnTypePtr;
+//Debug output would swamp any benchmark, so it's only printed when asked for. The if (0) keeps
+//the compiler checking the format strings.
+#ifdef HTTPD_POSIX_DEBUG
+#define httpd_printf(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+#define httpd_printf(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while(0)
+#endif
+#elif defined(FREERTOS)
 //#include "esp_timer.h"
 typedef struct RtosConnType RtosConnType;
 typedef RtosConnType* ConnTypePtr;
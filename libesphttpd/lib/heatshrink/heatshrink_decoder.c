@@ -62,12 +62,32 @@ heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
     size_t sz = sizeof(heatshrink_decoder) + buffers_sz;
     heatshrink_decoder *hsd = HEATSHRINK_MALLOC(sz);
     if (hsd == NULL) { return NULL; }
+    hsd = heatshrink_decoder_init(hsd, sz,
+        input_buffer_size, window_sz2, lookahead_sz2);
+    LOG("-- allocated decoder with buffer size of %zu (%zu + %u + %u)\n",
+        sz, sizeof(heatshrink_decoder), (1 << window_sz2), input_buffer_size);
+    return hsd;
+}
+
+heatshrink_decoder *heatshrink_decoder_init(void *mem, size_t mem_size,
+                                            uint16_t input_buffer_size,
+                                            uint8_t window_sz2,
+                                            uint8_t lookahead_sz2) {
+    if ((mem == NULL) ||
+        (window_sz2 < HEATSHRINK_MIN_WINDOW_BITS) ||
+        (window_sz2 > HEATSHRINK_MAX_WINDOW_BITS) ||
+        (input_buffer_size == 0) ||
+        (lookahead_sz2 < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||
+        (lookahead_sz2 > window_sz2)) {
+        return NULL;
+    }
+    size_t buffers_sz = (1 << window_sz2) + input_buffer_size;
+    if (sizeof(heatshrink_decoder) + buffers_sz > mem_size) { return NULL; }
+    heatshrink_decoder *hsd = (heatshrink_decoder *)mem;
     hsd->input_buffer_size = input_buffer_size;
     hsd->window_sz2 = window_sz2;
     hsd->lookahead_sz2 = lookahead_sz2;
     heatshrink_decoder_reset(hsd);
-    LOG("-- allocated decoder with buffer size of %zu (%zu + %u + %u)\n",
-        sz, sizeof(heatshrink_decoder), (1 << window_sz2), input_buffer_size);
     return hsd;
 }
 
@@ -81,6 +81,13 @@ heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
 
 /* Free a decoder. */
 void heatshrink_decoder_free(heatshrink_decoder *hsd);
+
+/* Set up a decoder like heatshrink_decoder_alloc does, but in the
+ * MEM_SIZE bytes at MEM, for callers that keep decoders in a pool.
+ * Returns NULL on error or if it doesn't fit. */
+heatshrink_decoder *heatshrink_decoder_init(void *mem, size_t mem_size,
+    uint16_t input_buffer_size, uint8_t expansion_buffer_sz2,
+    uint8_t lookahead_sz2);
 #endif
 
 /* Reset a decoder. */
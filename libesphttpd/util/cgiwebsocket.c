@@ -14,6 +14,7 @@ Websocket support for esphttpd. Inspired by https://github.com/dangrie158/ESP-82
 
 #include <esp8266.h>
 #include "httpd.h"
+#include "httpd-platform.h"
 #include "sha1.h"
 #include "base64.h"
 #include "cgiwebsocket.h"
@@ -84,6 +85,8 @@ struct WebsockPriv {
 	Websock *next; //in linked list
 };
 
+//List of open websockets. The httpd task adds and removes entries while other tasks may be
+//broadcasting, so it's only touched while holding the global httpd lock.
 static Websock *llStart=NULL;
 
 static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
@@ -121,16 +124,30 @@ int ICACHE_FLASH_ATTR cgiWebsocketSend(Websock *ws, char *data, int len, int fla
 
 //Broadcast data to all websockets at a specific url. Returns the amount of connections sent to.
 int ICACHE_FLASH_ATTR cgiWebsockBroadcast(char *resource, char *data, int len, int flags) {
-	Websock *lw=llStart;
-	int ret=0;
-	while (lw!=NULL) {
+	HttpdConnData *conns[HTTPD_MAX_CONNECTIONS];
+	unsigned int gens[HTTPD_MAX_CONNECTIONS];
+	Websock *lw;
+	int n=0, i, ret=0;
+	//Sending needs the lock of each connection, which can't be taken while holding the global lock.
+	//Note down where to send to, then send; a websocket that's closed meanwhile is skipped.
+	httpdPlatLock();
+	for (lw=llStart; lw!=NULL && n<HTTPD_MAX_CONNECTIONS; lw=lw->priv->next) {
 		if (strcmp(lw->conn->url, resource)==0) {
-			httpdConnSendStart(lw->conn);
+			conns[n]=lw->conn;
+			gens[n]=lw->conn->gen;
+			n++;
+		}
+	}
+	httpdPlatUnlock();
+	for (i=0; i<n; i++) {
+		if (!httpdConnSendStart(conns[i], gens[i])) continue;
+		//The connection can outlive its websocket, which is freed when a close frame comes in.
+		lw=(Websock*)conns[i]->cgiData;
+		if (lw!=NULL) {
 			cgiWebsocketSend(lw, data, len, flags);
-			httpdConnSendFinish(lw->conn);
 			ret++;
 		}
-		lw=lw->priv->next;
+		httpdConnSendFinish(conns[i]);
 	}
 	return ret;
 }
@@ -149,6 +166,7 @@ static void ICACHE_FLASH_ATTR websockFree(Websock *ws) {
 	httpd_printf("Ws: Free\n");
 	if (ws->closeCb) ws->closeCb(ws);
 	//Clean up linked list
+	httpdPlatLock();
 	if (llStart==ws) {
 		llStart=ws->priv->next;
 	} else if (llStart) {
@@ -157,6 +175,7 @@ static void ICACHE_FLASH_ATTR websockFree(Websock *ws) {
 		while (lws!=NULL && lws->priv->next!=ws) lws=lws->priv->next;
 		if (lws!=NULL) lws->priv->next=ws->priv->next;
 	}
+	httpdPlatUnlock();
 	if (ws->priv) free(ws->priv);
 }
 
@@ -275,6 +294,7 @@ int ICACHE_FLASH_ATTR cgiWebSocketRecv(HttpdConnData *connData, char *data, int
 //Websocket 'cgi' implementation
 int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 	char buff[256];
+	const char *upgrade;
 	int i;
 	sha1nfo s;
 	if (connData->conn==NULL) {
@@ -292,9 +312,9 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 	if (connData->cgiData==NULL) {
 //		httpd_printf("WS: First call\n");
 		//First call here. Check if client headers are OK, send server header.
-		i=httpdGetHeader(connData, "Upgrade", buff, sizeof(buff)-1);
-		httpd_printf("WS: Upgrade: %s\n", buff);
-		if (i && strcasecmp(buff, "websocket")==0) {
+		upgrade=httpdGetHeaderPtr(connData, "Upgrade", NULL);
+		httpd_printf("WS: Upgrade: %s\n", upgrade?upgrade:"");
+		if (upgrade!=NULL && strcasecmp(upgrade, "websocket")==0) {
 			i=httpdGetHeader(connData, "Sec-WebSocket-Key", buff, sizeof(buff)-1);
 			if (i) {
 //				httpd_printf("WS: Key: %s\n", buff);
@@ -333,6 +353,7 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 				WsConnectedCb connCb=connData->cgiArg;
 				connCb(ws);
 				//Insert ws into linked list
+				httpdPlatLock();
 				if (llStart==NULL) {
 					llStart=ws;
 				} else {
@@ -340,6 +361,7 @@ int ICACHE_FLASH_ATTR cgiWebsocket(HttpdConnData *connData) {
 					while (lw->priv->next) lw=lw->priv->next;
 					lw->priv->next=ws;
 				}
+				httpdPlatUnlock();
 				return HTTPD_CGI_MORE;
 			}
 		}